@@ -0,0 +1,258 @@
+/*
+ *  KUnit tests for the hid-microsoft report descriptor fixups
+ *
+ *  Included at the end of hid-microsoft.c, to reach its static functions.
+ *  The LK6K and 3000 descriptors have the size of the real ones, but only
+ *  the bytes the fixups look at are filled in. The Sidewinder ones are
+ *  built like those of tools/sidewinder-uhid.c.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <kunit/test.h>
+
+#define MS_TEST_LK6K_SIZE	571
+#define MS_TEST_3K_SIZE		106
+
+/*
+ * Sidewinder vendor interface, reduced to the S1 - S@keys block at offset
+ * 11 and @pad bits of padding after it
+ */
+#define MS_TEST_SW_RDESC(keys, pad)					\
+	0x05, 0x0c,		/* Usage Page (Consumer) */		\
+	0x09, 0x01,		/* Usage (Consumer Control) */		\
+	0xa1, 0x01,		/* Collection (Application) */		\
+	0x85, 0x08,		/*   Report ID (8) */			\
+	0x06, 0x00, 0xff,	/*   Usage Page (Vendor 0xff00) */	\
+	0x1a, 0x01, 0xfb,	/*   Usage Minimum (0xfb01) */		\
+	0x2a, (keys), 0xfb,	/*   Usage Maximum */			\
+	0x15, 0x00,		/*   Logical Minimum (0) */		\
+	0x25, 0x01,		/*   Logical Maximum (1) */		\
+	0x75, 0x01,		/*   Report Size (1) */			\
+	0x95, (keys),		/*   Report Count */			\
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */		\
+	0x95, (pad),		/*   Report Count */			\
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs) */		\
+	0xc0			/* End Collection */
+
+/* The same with the block collapsed by ms_sidewinder_macro_fixup() */
+#define MS_TEST_SW_RDESC_FIXED(keys, pad)				\
+	0x05, 0x0c, 0x09, 0x01, 0xa1, 0x01, 0x85, 0x08, 0x06, 0x00, 0xff, \
+	0x0a, 0x00, 0xfb,	/*   Usage (0xfb00) */			\
+	0x15, 0x00,		/*   Logical Minimum (0) */		\
+	0x27, (__u8)(BIT_ULL(keys) - 1), (__u8)((BIT_ULL(keys) - 1) >> 8), \
+	(__u8)((BIT_ULL(keys) - 1) >> 16), (__u8)((BIT_ULL(keys) - 1) >> 24), \
+				/*   Logical Maximum (2^keys - 1) */	\
+	0x75, (keys),		/*   Report Size */			\
+	0x95, 0x01,		/*   Report Count (1) */		\
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */		\
+	0x25, 0x01,		/*   Logical Maximum (1) */		\
+	0x75, 0x01,		/*   Report Size (1) */			\
+	0x95, (keys),		/*   Report Count */			\
+	0x95, (pad), 0x81, 0x03, 0xc0
+
+static const __u8 ms_test_sw_x6[] = { MS_TEST_SW_RDESC(30, 2) };
+static const __u8 ms_test_sw_x6_fixed[] = { MS_TEST_SW_RDESC_FIXED(30, 2) };
+static const __u8 ms_test_sw_x4[] = { MS_TEST_SW_RDESC(6, 2) };
+static const __u8 ms_test_sw_x4_fixed[] = { MS_TEST_SW_RDESC_FIXED(6, 2) };
+
+KUNIT_DEFINE_ACTION_WRAPPER(ms_test_hdev_destroy, hid_destroy_device,
+		struct hid_device *);
+
+/*
+ * A real, unregistered hid_device: the rewrites allocate the new
+ * descriptor with devm_kmalloc() on it, freed when the test ends.
+ */
+static struct hid_device *ms_test_hdev(struct kunit *test, __u16 product)
+{
+	struct hid_device *hdev = hid_allocate_device();
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, hdev);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test,
+			ms_test_hdev_destroy, hdev), 0);
+
+	hdev->vendor = USB_VENDOR_ID_MICROSOFT;
+	hdev->product = product;
+	return hdev;
+}
+
+static __u8 *ms_test_rdesc(struct kunit *test, unsigned int size)
+{
+	__u8 *rdesc = kunit_kzalloc(test, size, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, rdesc);
+	return rdesc;
+}
+
+/* Usage Min/Max of the Wireless Receiver 1028 become Physical Min/Max */
+static void ms_test_rdesc_lk6k(struct kunit *test)
+{
+	struct hid_device *hdev = ms_test_hdev(test, USB_DEVICE_ID_MS_LK6K);
+	__u8 *rdesc = ms_test_rdesc(test, MS_TEST_LK6K_SIZE);
+	unsigned int rsize = MS_TEST_LK6K_SIZE;
+
+	rdesc[557] = 0x19;
+	rdesc[559] = 0x29;
+
+	KUNIT_EXPECT_PTR_EQ(test, ms_report_fixup(hdev, rdesc, &rsize), rdesc);
+	KUNIT_EXPECT_EQ(test, rsize, MS_TEST_LK6K_SIZE);
+	KUNIT_EXPECT_EQ(test, rdesc[557], 0x35);
+	KUNIT_EXPECT_EQ(test, rdesc[559], 0x45);
+}
+
+/* Same for the Digital Media 3000, where all four bytes are checked */
+static void ms_test_rdesc_3k(struct kunit *test)
+{
+	struct hid_device *hdev = ms_test_hdev(test,
+			USB_DEVICE_ID_MS_DIGITAL_MEDIA_3K);
+	__u8 *rdesc = ms_test_rdesc(test, MS_TEST_3K_SIZE);
+	unsigned int rsize = MS_TEST_3K_SIZE;
+
+	rdesc[94] = 0x19;
+	rdesc[95] = 0x00;
+	rdesc[96] = 0x29;
+	rdesc[97] = 0xff;
+
+	KUNIT_EXPECT_PTR_EQ(test, ms_report_fixup(hdev, rdesc, &rsize), rdesc);
+	KUNIT_EXPECT_EQ(test, rsize, MS_TEST_3K_SIZE);
+	KUNIT_EXPECT_EQ(test, rdesc[94], 0x35);
+	KUNIT_EXPECT_EQ(test, rdesc[95], 0x00);
+	KUNIT_EXPECT_EQ(test, rdesc[96], 0x45);
+	KUNIT_EXPECT_EQ(test, rdesc[97], 0xff);
+}
+
+/*
+ * Right size, but one checked byte differs: not patched at all, only the
+ * unknown revision warning is logged.
+ */
+static void ms_test_rdesc_unknown(struct kunit *test)
+{
+	struct hid_device *hdev = ms_test_hdev(test,
+			USB_DEVICE_ID_MS_DIGITAL_MEDIA_3K);
+	__u8 *rdesc = ms_test_rdesc(test, MS_TEST_3K_SIZE);
+	__u8 *orig = ms_test_rdesc(test, MS_TEST_3K_SIZE);
+	unsigned int rsize = MS_TEST_3K_SIZE;
+
+	rdesc[94] = 0x19;
+	rdesc[96] = 0x29;
+	rdesc[97] = 0x7f;
+	memcpy(orig, rdesc, MS_TEST_3K_SIZE);
+
+	KUNIT_EXPECT_PTR_EQ(test, ms_report_fixup(hdev, rdesc, &rsize), rdesc);
+	KUNIT_EXPECT_EQ(test, rsize, MS_TEST_3K_SIZE);
+	KUNIT_EXPECT_MEMEQ(test, rdesc, orig, MS_TEST_3K_SIZE);
+}
+
+/*
+ * An entry with a crc32 only patches the exact descriptor it was taken
+ * from, even if all patch bytes of another one hold their expected value
+ */
+static void ms_test_rdesc_crc32(struct kunit *test)
+{
+	struct hid_device *hdev = ms_test_hdev(test, USB_DEVICE_ID_MS_LK6K);
+	__u8 *rdesc = ms_test_rdesc(test, MS_TEST_LK6K_SIZE);
+	__u8 *orig = ms_test_rdesc(test, MS_TEST_LK6K_SIZE);
+	unsigned int rsize = MS_TEST_LK6K_SIZE;
+	struct ms_rdesc_fixup fixup = MS_RDESC_FIXUP(USB_VENDOR_ID_MICROSOFT,
+			USB_DEVICE_ID_MS_LK6K, MS_TEST_LK6K_SIZE, 0,
+			"test descriptor", ms_rdesc_lk6k);
+
+	rdesc[557] = 0x19;
+	rdesc[559] = 0x29;
+	fixup.crc32 = ~crc32_le(~0, rdesc, MS_TEST_LK6K_SIZE);
+	KUNIT_ASSERT_NE(test, fixup.crc32, 0);
+
+	/* Another revision, with the same patch bytes */
+	rdesc[0] = 0x05;
+	memcpy(orig, rdesc, MS_TEST_LK6K_SIZE);
+	KUNIT_EXPECT_PTR_EQ(test, __ms_report_fixup(hdev, rdesc, &rsize,
+			&fixup, 1), rdesc);
+	KUNIT_EXPECT_EQ(test, rsize, MS_TEST_LK6K_SIZE);
+	KUNIT_EXPECT_MEMEQ(test, rdesc, orig, MS_TEST_LK6K_SIZE);
+
+	/* The one the crc32 was taken from */
+	rdesc[0] = 0x00;
+	KUNIT_EXPECT_PTR_EQ(test, __ms_report_fixup(hdev, rdesc, &rsize,
+			&fixup, 1), rdesc);
+	KUNIT_EXPECT_EQ(test, rsize, MS_TEST_LK6K_SIZE);
+	KUNIT_EXPECT_EQ(test, rdesc[557], 0x35);
+	KUNIT_EXPECT_EQ(test, rdesc[559], 0x45);
+}
+
+/* Feed @size bytes of @src through ms_report_fixup() for @product */
+static void ms_test_rdesc_rewrite(struct kunit *test, __u16 product,
+		const __u8 *src, unsigned int size,
+		const __u8 *expected, unsigned int expected_size)
+{
+	struct hid_device *hdev = ms_test_hdev(test, product);
+	__u8 *rdesc = ms_test_rdesc(test, size);
+	unsigned int rsize = size;
+	const __u8 *fixed;
+
+	memcpy(rdesc, src, size);
+	fixed = ms_report_fixup(hdev, rdesc, &rsize);
+
+	KUNIT_ASSERT_EQ(test, rsize, expected_size);
+	KUNIT_EXPECT_MEMEQ(test, fixed, expected, expected_size);
+	/* The original is left as it was */
+	KUNIT_EXPECT_MEMEQ(test, rdesc, src, size);
+}
+
+/* S1 - S30 collapsed into one 30 bit field, 6 bytes longer */
+static void ms_test_rdesc_x6(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, sizeof(ms_test_sw_x6_fixed),
+			sizeof(ms_test_sw_x6) + 6);
+	ms_test_rdesc_rewrite(test, USB_DEVICE_ID_SIDEWINDER_X6,
+			ms_test_sw_x6, sizeof(ms_test_sw_x6),
+			ms_test_sw_x6_fixed, sizeof(ms_test_sw_x6_fixed));
+}
+
+/* Same with the six keys of the X4 */
+static void ms_test_rdesc_x4(struct kunit *test)
+{
+	ms_test_rdesc_rewrite(test, USB_DEVICE_ID_SIDEWINDER_X4,
+			ms_test_sw_x4, sizeof(ms_test_sw_x4),
+			ms_test_sw_x4_fixed, sizeof(ms_test_sw_x4_fixed));
+}
+
+/* Without the exact block, here with 2 bit keys, nothing is rewritten */
+static void ms_test_rdesc_x6_no_block(struct kunit *test)
+{
+	struct hid_device *hdev = ms_test_hdev(test, USB_DEVICE_ID_SIDEWINDER_X6);
+	__u8 *rdesc = ms_test_rdesc(test, sizeof(ms_test_sw_x6));
+	unsigned int rsize = sizeof(ms_test_sw_x6);
+
+	memcpy(rdesc, ms_test_sw_x6, sizeof(ms_test_sw_x6));
+	rdesc[22] = 0x02;	/* Report Size (2) */
+
+	KUNIT_EXPECT_PTR_EQ(test, ms_report_fixup(hdev, rdesc, &rsize), rdesc);
+	KUNIT_EXPECT_EQ(test, rsize, sizeof(ms_test_sw_x6));
+	KUNIT_EXPECT_EQ(test, rdesc[22], 0x02);
+	KUNIT_EXPECT_MEMEQ(test, rdesc, ms_test_sw_x6, 22);
+	KUNIT_EXPECT_MEMEQ(test, rdesc + 23, ms_test_sw_x6 + 23,
+			sizeof(ms_test_sw_x6) - 23);
+}
+
+static struct kunit_case ms_rdesc_test_cases[] = {
+	KUNIT_CASE(ms_test_rdesc_lk6k),
+	KUNIT_CASE(ms_test_rdesc_3k),
+	KUNIT_CASE(ms_test_rdesc_unknown),
+	KUNIT_CASE(ms_test_rdesc_crc32),
+	KUNIT_CASE(ms_test_rdesc_x6),
+	KUNIT_CASE(ms_test_rdesc_x4),
+	KUNIT_CASE(ms_test_rdesc_x6_no_block),
+	{}
+};
+
+static struct kunit_suite ms_rdesc_test_suite = {
+	.name = "hid_microsoft_rdesc",
+	.test_cases = ms_rdesc_test_cases,
+};
+
+kunit_test_suite(ms_rdesc_test_suite);
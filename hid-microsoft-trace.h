@@ -0,0 +1,113 @@
+/*
+ *  Tracepoints for the HID driver for some microsoft "special" devices
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hid_microsoft
+
+#if !defined(HID_MICROSOFT_TRACE_H_FILE) || defined(TRACE_HEADER_MULTI_READ)
+#define HID_MICROSOFT_TRACE_H_FILE
+
+#include <linux/hid.h>
+#include <linux/tracepoint.h>
+
+/* An input report reached the driver */
+TRACE_EVENT(ms_report,
+	TP_PROTO(struct hid_device *hdev, struct hid_report *report, int size),
+	TP_ARGS(hdev, report, size),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(unsigned int, report)
+		__field(int, size)
+	),
+	TP_fast_assign(
+		__entry->dev = hdev->id;
+		__entry->report = report->id;
+		__entry->size = size;
+	),
+	TP_printk("dev=%u report=%u size=%d",
+		__entry->dev, __entry->report, __entry->size)
+);
+
+/* A vendor usage was decoded */
+TRACE_EVENT(ms_key,
+	TP_PROTO(struct hid_device *hdev, unsigned int usage, int value),
+	TP_ARGS(hdev, usage, value),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(unsigned int, usage)
+		__field(int, value)
+	),
+	TP_fast_assign(
+		__entry->dev = hdev->id;
+		__entry->usage = usage;
+		__entry->value = value;
+	),
+	TP_printk("dev=%u usage=0x%08x value=%d",
+		__entry->dev, __entry->usage, __entry->value)
+);
+
+/* The driver sent an input event */
+TRACE_EVENT(ms_input,
+	TP_PROTO(struct hid_device *hdev, unsigned int type, unsigned int code,
+		int value),
+	TP_ARGS(hdev, type, code, value),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(unsigned int, type)
+		__field(unsigned int, code)
+		__field(int, value)
+	),
+	TP_fast_assign(
+		__entry->dev = hdev->id;
+		__entry->type = type;
+		__entry->code = code;
+		__entry->value = value;
+	),
+	TP_printk("dev=%u type=%u code=%u value=%d",
+		__entry->dev, __entry->type, __entry->code, __entry->value)
+);
+
+DECLARE_EVENT_CLASS(ms_set_report,
+	TP_PROTO(struct hid_device *hdev, __u8 status, s64 latency),
+	TP_ARGS(hdev, status, latency),
+	TP_STRUCT__entry(
+		__field(unsigned int, dev)
+		__field(__u8, status)
+		__field(s64, latency)
+	),
+	TP_fast_assign(
+		__entry->dev = hdev->id;
+		__entry->status = status;
+		__entry->latency = latency;
+	),
+	TP_printk("dev=%u status=0x%02x latency=%lldns",
+		__entry->dev, __entry->status, __entry->latency)
+);
+
+/* A Sidewinder LED SET_REPORT is about to be sent, @latency since requested */
+DEFINE_EVENT(ms_set_report, ms_set_report_submit,
+	TP_PROTO(struct hid_device *hdev, __u8 status, s64 latency),
+	TP_ARGS(hdev, status, latency)
+);
+
+/* The keyboard completed it, @latency since requested */
+DEFINE_EVENT(ms_set_report, ms_set_report_complete,
+	TP_PROTO(struct hid_device *hdev, __u8 status, s64 latency),
+	TP_ARGS(hdev, status, latency)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hid-microsoft-trace
+#include <trace/define_trace.h>
@@ -15,169 +15,911 @@
  * any later version.
  */
 
+#include <linux/bitfield.h>
+#include <linux/bsearch.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/jump_label.h>
 #include <linux/input.h>
 #include <linux/hid.h>
+#include <linux/ktime.h>
+#include <linux/kref.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/sysfs.h>
+#include <linux/uaccess.h>
 #include <linux/usb.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "hid-ids.h"
+#include "hid-sidewinder.h"
+
+#define CREATE_TRACE_POINTS
+#include "hid-microsoft-trace.h"
 
 #define MS_HIDINPUT		0x01
 #define MS_ERGONOMY		0x02
 #define MS_PRESENTER		0x04
-#define MS_RDESC		0x08
 #define MS_NOGET		0x10
 #define MS_DUPLICATE_USAGES	0x20
-#define MS_RDESC_3K		0x40
 #define MS_SIDEWINDER	0x80
 
+/* Quirks that look at every report, everything else is passed through */
+#define MS_REPORT_QUIRKS	(MS_ERGONOMY | MS_PRESENTER | MS_SIDEWINDER)
+
+static bool macro_keys;
+module_param(macro_keys, bool, 0644);
+MODULE_PARM_DESC(macro_keys, "Report Sidewinder S1 - S30, profile and macro pad keys as input events, not only via sysfs key_mask (default: off)");
+
+static bool macro_record;
+module_param(macro_record, bool, 0644);
+MODULE_PARM_DESC(macro_record, "Record and replay Sidewinder macros in the driver, using the Macro Record key (default: off)");
+
+static unsigned int led_rate = 50;
+module_param(led_rate, uint, 0644);
+MODULE_PARM_DESC(led_rate, "Maximum number of Sidewinder LED updates sent per second, 0 for no limit (default: 50)");
+
+static bool nkro;
+module_param(nkro, bool, 0644);
+MODULE_PARM_DESC(nkro, "Decode the key bitmap of Sidewinder keyboard interfaces in one pass, for keyboards bound afterwards (default: off)");
+
+/*
+ * Latency histogram, bucket n counts latencies below 2^n us, the last
+ * one everything slower.
+ */
+#define MS_LATENCY_BUCKETS	21
+
+struct ms_latency {
+	atomic_long_t bucket[MS_LATENCY_BUCKETS];
+};
+
+/*
+ * Per-CPU driver statistics, summed up when read from debugfs
+ */
+enum {
+	MS_STAT_REPORTS,
+	MS_STAT_USAGES_ERGONOMY,
+	MS_STAT_USAGES_PRESENTER,
+	MS_STAT_USAGES_SIDEWINDER,
+	MS_STAT_MACRO_KEYS,
+	MS_STAT_NKRO_KEYS,
+	MS_STAT_SET_REPORT_ISSUED,
+	MS_STAT_SET_REPORT_SKIPPED,
+	MS_STAT_STORE_INVALID,
+	MS_STAT_MAX
+};
+
+static const char * const ms_stat_names[] = {
+	[MS_STAT_REPORTS] = "reports",
+	[MS_STAT_USAGES_ERGONOMY] = "usages_ergonomy",
+	[MS_STAT_USAGES_PRESENTER] = "usages_presenter",
+	[MS_STAT_USAGES_SIDEWINDER] = "usages_sidewinder",
+	[MS_STAT_MACRO_KEYS] = "macro_key_transitions",
+	[MS_STAT_NKRO_KEYS] = "nkro_key_transitions",
+	[MS_STAT_SET_REPORT_ISSUED] = "set_report_issued",
+	[MS_STAT_SET_REPORT_SKIPPED] = "set_report_skipped",
+	[MS_STAT_STORE_INVALID] = "sysfs_store_invalid",
+};
+
+struct ms_stats {
+	u64 count[MS_STAT_MAX];
+};
+
+#define ms_stat_inc(sc, stat)	this_cpu_inc((sc)->stats->count[stat])
+
+/*
+ * @stats: per-CPU counters, see above.
+ * @report_time: arrival of the report being handled.
+ * @input_latency: report arrival to input event, per event sent.
+ * @led_latency: Sidewinder LED update request to SET_REPORT completion.
+ * @debugfs: per device directory, holding the histograms.
+ * @usages: vendor usages of the device family, see ms_usage_lookup().
+ * @event: per usage decoder of this interface, picked before hid-input
+ * registers its first input device, NULL if hid-input handles everything
+ * on its own.
+ */
+typedef int (*ms_event_t)(struct hid_device *hdev, struct hid_field *field,
+		struct hid_usage *usage, __s32 value);
+
 struct ms_data {
 	unsigned long quirks;
+	const struct ms_usage_table *usages;
+	ms_event_t event;
 	void *extra;
+	ktime_t report_time;
+	struct ms_latency input_latency;
+	struct ms_latency led_latency;
+	struct dentry *debugfs;
+	struct ms_stats __percpu *stats;
 };
 
+static struct dentry *ms_debugfs_root;
+
+/*
+ * Enabled while at least one bound interface has an ms_data->event
+ * decoder, or is a Sidewinder, so devices that need neither do not even
+ * look at their drvdata for each usage or report.
+ */
+static DEFINE_STATIC_KEY_FALSE(ms_event_key);
+static DEFINE_STATIC_KEY_FALSE(ms_sidewinder_key);
+
+/*
+ * Enabled while at least one bound interface has one of the
+ * MS_REPORT_QUIRKS, the per report statistics and timestamps are not
+ * worth anything otherwise.
+ */
+static DEFINE_STATIC_KEY_FALSE(ms_report_key);
+
+static void ms_latency_add(struct ms_latency *lat, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	unsigned int n = us > 0 ? fls64(us) : 0;
+
+	atomic_long_inc(&lat->bucket[min_t(unsigned int, n, MS_LATENCY_BUCKETS - 1)]);
+}
+
+/* input_event() for events caused by the report being handled */
+static void ms_input_event(struct hid_device *hdev, struct input_dev *input,
+		unsigned int type, unsigned int code, int value)
+{
+	struct ms_data *sc = hid_get_drvdata(hdev);
+
+	trace_ms_input(hdev, type, code, value);
+	input_event(input, type, code, value);
+	ms_latency_add(&sc->input_latency, sc->report_time);
+}
+
+#define MS_ERGONOMY_FAVORITES		5
+
+/*
+ * For keyboards with the MS_ERGONOMY quirk.
+ * @last_mask: F14 - F18 keys pressed through the favorites usage, one bit
+ * per key as in the report. Kept per device, in its own cacheline, so
+ * keyboards handled on different CPUs share nothing.
+ * @key_code: keycode sent for each favorites key, F14 - F18 unless
+ * remapped with EVIOCSKEYCODE.
+ * @input: input device the favorites usage is mapped on.
+ * @getkeycode: hid-input's handler, for all other scancodes.
+ * @setkeycode: likewise.
+ */
+struct ms_ergonomy_extra {
+	__u8 last_mask;
+	__u16 key_code[MS_ERGONOMY_FAVORITES];
+	struct input_dev *input;
+	int (*getkeycode)(struct input_dev *input,
+			struct input_keymap_entry *ke);
+	int (*setkeycode)(struct input_dev *input,
+			const struct input_keymap_entry *ke,
+			unsigned int *old_keycode);
+} ____cacheline_aligned;
+
 /*
  * For Sidewinder X4 / X6 devices.
- * @profile: currently, only 3 profiles are used, eventhough it would
- * be possible to set up more (combining LEDs 1 -3 for profile
- * indication).
- * @status: holds information about LED states and numpad mode (X6
- * only). The 1st bit is for numpad mode, bits 2 - 7 are reserved for
- * LED configuration and the last bit is currently unused.
- * @key_mask: holds information about pressed special keys. It's
- * readable via sysfs, so user-space tools can handle keypresses.
+ * @state: profile, status and key_mask packed into one word, see
+ * MS_SIDEWINDER_STATE_*. It is only changed by cmpxchg, so the event path
+ * never waits for sysfs and readers always see a consistent snapshot.
+ * Every change also bumps the generation counter in its top bits.
+ *  - profile: currently, only 3 profiles are used, eventhough it would
+ *    be possible to set up more (combining LEDs 1 -3 for profile
+ *    indication).
+ *  - status: holds information about LED states and numpad mode (X6
+ *    only). The 1st bit is for numpad mode, bits 2 - 7 are reserved for
+ *    LED configuration and the last bit is currently unused.
+ *  - key_mask: holds information about pressed special keys. It's
+ *    readable via sysfs, so user-space tools can handle keypresses.
+ * @macro_keys: S1 - S30 keys that can be decoded straight from the raw
+ * report by ms_raw_event(), instead of one ms_event() call per usage.
+ * @macro_report: id of the input report carrying those keys.
+ * @macro_offset: bit offset of each macro key within that report.
+ * @macro_usage: usage of each macro key. Its code is what gets reported
+ * by default, so EVIOCSKEYCODE on hid-input remaps the key.
+ * @macro_bitmap: the keys come from the single field made by
+ * ms_sidewinder_macro_fixup(), so they have no usage of their own.
+ * @macro_code: default keycode of each key then, remapped with
+ * EVIOCSKEYCODE through @getkeycode and @setkeycode.
+ * @getkeycode: hid-input's handler, for all other scancodes.
+ * @setkeycode: likewise.
+ * @input: input device the S1 - S30 keys are mapped on.
+ * @emit_keys: report S1 - S30, profile and macro pad keys as input
+ * events. Initialized from the macro_keys module parameter.
+ * @notify: sysfs attributes changed while handling the current report.
+ * They are notified once per report, so user-space can poll() on them.
+ * @kn: sysfs nodes of those attributes.
+ * @ring: S1 - S30 event ring and state page, exposed through
+ * /dev/sidewinderN.
+ * @hdev: device the LED feature report is sent to.
+ * @led_work: sends the latest @status to the keyboard, so neither the
+ * event path nor sysfs writers wait for the USB control pipe, and a burst
+ * of changes ends up as a single SET_REPORT.
+ * @led_lock: protects @led_dead against scheduling @led_work.
+ * @led_dead: set on removal, no more @led_work may be scheduled.
+ * @led_sent: @status as last sent to the keyboard.
+ * @led_rate: maximum number of SET_REPORTs per second, 0 for no limit.
+ * Initialized from the led_rate module parameter.
+ * @led_last: time of the last SET_REPORT.
+ * @led_issued: number of SET_REPORTs sent.
+ * @led_merged: number of updates merged into an already pending one.
+ * @led_dropped: number of pending updates not sent, because the keyboard
+ * already was in that state.
+ * @led_requested: time of the oldest update not sent yet, 0 if none.
+ * @group: state shared by all interfaces of the same keyboard.
+ * @keymap: per profile S1 - S30 remapping tables, see below. The event
+ * path picks the table under RCU from the profile in @state, so switching
+ * profile only changes @state.
+ * @keymap_lock: serializes writers of @keymap.
+ * @key_code: keycode sent for each S key still pressed, so its release
+ * matches even if the profile changed in between.
+ * @key_default: S keys pressed while sent with their default keycode, for
+ * releasing them when emit_keys gets turned off.
+ * @key_lock: serializes @key_code, @key_default and the @emit_keys
+ * updates between the event path and sysfs.
+ * @nkro: key bitmap decoded by ms_raw_event(), NULL if left to hid-core.
  */
+#define MS_SIDEWINDER_MACRO_KEYS	30
+#define MS_SIDEWINDER_PROFILES		3
+
+enum {
+	MS_SIDEWINDER_NOTIFY_KEY_MASK,
+	MS_SIDEWINDER_NOTIFY_PROFILE,
+	MS_SIDEWINDER_NOTIFY_RECORD,
+	MS_SIDEWINDER_NOTIFY_AUTO,
+	MS_SIDEWINDER_NOTIFY_MAX
+};
+
+#define MS_SIDEWINDER_STATE_KEY_MASK	GENMASK_ULL(29, 0)
+#define MS_SIDEWINDER_STATE_STATUS	GENMASK_ULL(39, 32)
+#define MS_SIDEWINDER_STATE_PROFILE	GENMASK_ULL(41, 40)
+#define MS_SIDEWINDER_STATE_GENERATION	GENMASK_ULL(63, 42)
+
 struct ms_sidewinder_extra {
-	unsigned profile;
-	__u8 status;
-	unsigned long key_mask;
+	atomic64_t state;
+	unsigned long macro_keys;
+	unsigned macro_report;
+	__u16 macro_offset[MS_SIDEWINDER_MACRO_KEYS];
+	struct hid_usage *macro_usage[MS_SIDEWINDER_MACRO_KEYS];
+	bool macro_bitmap;
+	__u16 macro_code[MS_SIDEWINDER_MACRO_KEYS];
+	int (*getkeycode)(struct input_dev *input,
+			struct input_keymap_entry *ke);
+	int (*setkeycode)(struct input_dev *input,
+			const struct input_keymap_entry *ke,
+			unsigned int *old_keycode);
+	struct input_dev *input;
+	bool emit_keys;
+	unsigned long notify;
+	struct kernfs_node *kn[MS_SIDEWINDER_NOTIFY_MAX];
+	struct ms_sidewinder_ring *ring;
+	struct hid_device *hdev;
+	struct delayed_work led_work;
+	spinlock_t led_lock;
+	bool led_dead;
+	__u8 led_sent;
+	unsigned int led_rate;
+	ktime_t led_last;
+	atomic_long_t led_issued;
+	atomic_long_t led_merged;
+	atomic_long_t led_dropped;
+	atomic64_t led_requested;
+	struct ms_sidewinder_group *group;
+	struct ms_sidewinder_keymap __rcu *keymap[MS_SIDEWINDER_PROFILES];
+	struct mutex keymap_lock;
+	__u16 key_code[MS_SIDEWINDER_MACRO_KEYS];
+	unsigned long key_default;
+	spinlock_t key_lock;
+	struct ms_sidewinder_nkro *nkro;
 };
 
-static __u8 *ms_report_fixup(struct hid_device *hdev, __u8 *rdesc,
-		unsigned int *rsize)
+/*
+ * Anti-ghosting key bitmap of a Sidewinder keyboard interface, one bit per
+ * key. Only reports with at least MS_SIDEWINDER_NKRO_MIN_KEYS such bits are
+ * worth it, which leaves boot protocol modifier bytes to hid-core.
+ * @report: input report carrying the bitmap.
+ * @input: input device hid-input mapped its keys to.
+ * @start: byte of the report (without report id) the bitmap starts at.
+ * @bits: length of the bitmap from there.
+ * @keys: bits that are mapped keys, everything else is ignored.
+ * @last: bitmap of the previous report.
+ * @usage: usage of each bit, for the keycode hid-input maps it to.
+ */
+#define MS_SIDEWINDER_NKRO_BITS		256
+#define MS_SIDEWINDER_NKRO_MIN_KEYS	32
+
+struct ms_sidewinder_nkro {
+	struct hid_report *report;
+	struct input_dev *input;
+	unsigned int start;
+	unsigned int bits;
+	DECLARE_BITMAP(keys, MS_SIDEWINDER_NKRO_BITS);
+	DECLARE_BITMAP(last, MS_SIDEWINDER_NKRO_BITS);
+	struct hid_usage *usage[MS_SIDEWINDER_NKRO_BITS];
+};
+
+/*
+ * Sidewinder S1 - S30 keymap of one profile
+ * @code: keycode sent for each key, 0 for the default behaviour
+ * (KEY_MACRO1 - KEY_MACRO30 if emit_keys is set, nothing otherwise).
+ * Tables are never changed in place, writers replace them.
+ */
+struct ms_sidewinder_keymap {
+	struct rcu_head rcu;
+	__u16 code[MS_SIDEWINDER_MACRO_KEYS];
+};
+
+/*
+ * Sidewinder event ring
+ *
+ * Single producer (the report handlers of one device), lock-free ring of
+ * struct ms_sidewinder_event. Every open file keeps its own read position,
+ * readers that fall more than a ring behind lose the oldest events. The
+ * ring is refcounted, so open files outlive the device.
+ */
+#define MS_SIDEWINDER_RING_EVENTS	256
+
+struct ms_sidewinder_ring {
+	struct kref ref;
+	struct miscdevice misc;
+	char name[24];
+	wait_queue_head_t wait;
+	bool dead;
+	struct ms_sidewinder_ring_header *header;
+	struct ms_sidewinder_event *events;
+	spinlock_t state_lock;
+	struct ms_sidewinder_state_page *state;
+};
+
+struct ms_sidewinder_reader {
+	struct ms_sidewinder_ring *ring;
+	__u32 tail;
+};
+
+/*
+ * S1 - S30 block of the Sidewinder vendor interface, one usage and one bit
+ * per key: Usage Minimum (0xfb01), Usage Maximum (0xfb00 + n), Logical
+ * Minimum (0), Logical Maximum (1), Report Size (1), Report Count (n),
+ * Input (Data,Var,Abs). The two n bytes are not compared.
+ */
+static const __u8 ms_sidewinder_macro_block[] = {
+	0x1a, 0x01, 0xfb, 0x2a, 0x00, 0xfb, 0x15, 0x00,
+	0x25, 0x01, 0x75, 0x01, 0x95, 0x00, 0x81, 0x02
+};
+
+#define MS_SIDEWINDER_MACRO_BLOCK_MAX	4
+#define MS_SIDEWINDER_MACRO_BLOCK_COUNT	13
+#define MS_SIDEWINDER_MACRO_FIXUP_SIZE	22
+
+/* Length of the item starting at @item, long items included */
+static unsigned int ms_item_size(const __u8 *item)
 {
-	struct ms_data *sc = hid_get_drvdata(hdev);
+	unsigned int size = item[0] & 0x03;
 
-	/*
-	 * Microsoft Wireless Desktop Receiver (Model 1028) has
-	 * 'Usage Min/Max' where it ought to have 'Physical Min/Max'
-	 */
-	if ((sc->quirks & MS_RDESC) && *rsize == 571 && rdesc[557] == 0x19 &&
-			rdesc[559] == 0x29) {
-		hid_info(hdev, "fixing up Microsoft Wireless Receiver Model 1028 report descriptor\n");
-		rdesc[557] = 0x35;
-		rdesc[559] = 0x45;
+	if (item[0] == 0xfe)
+		return 3 + item[1];
+	return 1 + (size == 3 ? 4 : size);
+}
+
+static bool ms_sidewinder_macro_match(const __u8 *item, unsigned int n)
+{
+	unsigned int i;
+
+	if (n < 1 || n > MS_SIDEWINDER_MACRO_KEYS ||
+			item[MS_SIDEWINDER_MACRO_BLOCK_MAX] != n)
+		return false;
+
+	for (i = 0; i < sizeof(ms_sidewinder_macro_block); i++) {
+		if (i != MS_SIDEWINDER_MACRO_BLOCK_MAX &&
+				i != MS_SIDEWINDER_MACRO_BLOCK_COUNT &&
+				item[i] != ms_sidewinder_macro_block[i])
+			return false;
 	}
-	/* the same as above (s/usage/physical/) */
-	if ((sc->quirks & MS_RDESC_3K) && *rsize == 106 && rdesc[94] == 0x19 &&
-			rdesc[95] == 0x00 && rdesc[96] == 0x29 &&
-			rdesc[97] == 0xff) {
-		rdesc[94] = 0x35;
-		rdesc[96] = 0x45;
+	return true;
+}
+
+/*
+ * Turn the S1 - S30 keys into a single n bit field with a single usage
+ * (0xfb00), so hid-core calls ms_event() once per report for them instead
+ * of once per key. ms_raw_event() decodes the bitmap either way. The
+ * globals the block changed are restored right after it, for the items
+ * that follow. Descriptors without the exact block are left alone.
+ */
+static const __u8 *ms_sidewinder_macro_fixup(struct hid_device *hdev,
+		__u8 *rdesc, unsigned int *rsize)
+{
+	unsigned int p, n, size = sizeof(ms_sidewinder_macro_block);
+	u32 max;
+	__u8 *fixed, *q;
+
+	for (p = 0; p + size <= *rsize; p += ms_item_size(rdesc + p)) {
+		n = rdesc[p + MS_SIDEWINDER_MACRO_BLOCK_COUNT];
+		if (ms_sidewinder_macro_match(rdesc + p, n))
+			break;
 	}
-	return rdesc;
+	if (p + size > *rsize)
+		return rdesc;
+
+	fixed = devm_kmalloc(&hdev->dev,
+			*rsize - size + MS_SIDEWINDER_MACRO_FIXUP_SIZE, GFP_KERNEL);
+	if (!fixed)
+		return rdesc;
+
+	hid_info(hdev, "collapsing %u Sidewinder macro keys into one field (report descriptor size %u, crc32 %08x)\n",
+			n, *rsize, ~crc32_le(~0, rdesc, *rsize));
+
+	max = BIT_ULL(n) - 1;
+	q = fixed;
+	memcpy(q, rdesc, p);
+	q += p;
+	*q++ = 0x0a; *q++ = 0x00; *q++ = 0xfb;		/* Usage (0xfb00) */
+	*q++ = 0x15; *q++ = 0x00;			/* Logical Minimum (0) */
+	*q++ = 0x27;					/* Logical Maximum (2^n - 1) */
+	*q++ = max; *q++ = max >> 8; *q++ = max >> 16; *q++ = max >> 24;
+	*q++ = 0x75; *q++ = n;				/* Report Size (n) */
+	*q++ = 0x95; *q++ = 0x01;			/* Report Count (1) */
+	*q++ = 0x81; *q++ = 0x02;			/* Input (Data,Var,Abs) */
+	*q++ = 0x25; *q++ = 0x01;			/* Logical Maximum (1) */
+	*q++ = 0x75; *q++ = 0x01;			/* Report Size (1) */
+	*q++ = 0x95; *q++ = n;				/* Report Count (n) */
+	memcpy(q, rdesc + p + size, *rsize - p - size);
+
+	*rsize += MS_SIDEWINDER_MACRO_FIXUP_SIZE - size;
+	return fixed;
 }
 
-#define ms_map_key_clear(c)	hid_map_usage_clear(hi, usage, bit, max, \
-					EV_KEY, (c))
-static int ms_ergonomy_kb_quirk(struct hid_input *hi, struct hid_usage *usage,
-		unsigned long **bit, int *max)
+/*
+ * Report descriptor fixups
+ *
+ * Each entry fixes one known descriptor, told apart by its device, size
+ * and, if non-zero, crc32. Every patch byte must hold its expected value
+ * before any of them is applied, so a descriptor that only looks the same
+ * is never half patched. Patches with the same expected and new value only
+ * check the descriptor. Entries with a @rewrite function instead change
+ * the descriptor size, they can match any size (0) and look for what they
+ * rewrite themselves.
+ */
+struct ms_rdesc_patch {
+	__u16 offset;
+	__u8 expected;
+	__u8 value;
+};
+
+struct ms_rdesc_fixup {
+	__u16 vendor;
+	__u16 product;
+	unsigned int size;
+	u32 crc32;
+	const char *name;
+	const struct ms_rdesc_patch *patches;
+	unsigned int count;
+	const __u8 *(*rewrite)(struct hid_device *hdev, __u8 *rdesc,
+			unsigned int *rsize);
+};
+
+#define MS_RDESC_FIXUP(v, p, sz, crc, n, list)				\
+	{ .vendor = (v), .product = (p), .size = (sz), .crc32 = (crc),	\
+	  .name = (n), .patches = (list), .count = ARRAY_SIZE(list) }
+
+#define MS_RDESC_REWRITE(v, p, sz, crc, n, fn)				\
+	{ .vendor = (v), .product = (p), .size = (sz), .crc32 = (crc),	\
+	  .name = (n), .rewrite = (fn) }
+
+/*
+ * Microsoft Wireless Desktop Receiver (Model 1028) has
+ * 'Usage Min/Max' where it ought to have 'Physical Min/Max'
+ */
+static const struct ms_rdesc_patch ms_rdesc_lk6k[] = {
+	{ 557, 0x19, 0x35 },
+	{ 559, 0x29, 0x45 },
+};
+
+/* the same as above (s/usage/physical/) */
+static const struct ms_rdesc_patch ms_rdesc_3k[] = {
+	{ 94, 0x19, 0x35 },
+	{ 95, 0x00, 0x00 },
+	{ 96, 0x29, 0x45 },
+	{ 97, 0xff, 0xff },
+};
+
+static const struct ms_rdesc_fixup ms_rdesc_fixups[] = {
+	MS_RDESC_FIXUP(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_MS_LK6K, 571, 0,
+		"Microsoft Wireless Receiver Model 1028", ms_rdesc_lk6k),
+	MS_RDESC_FIXUP(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_MS_DIGITAL_MEDIA_3K,
+		106, 0, "Microsoft Digital Media Keyboard 3000", ms_rdesc_3k),
+	MS_RDESC_REWRITE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_SIDEWINDER_X6, 0, 0,
+		"Microsoft Sidewinder X6", ms_sidewinder_macro_fixup),
+	MS_RDESC_REWRITE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_SIDEWINDER_X4, 0, 0,
+		"Microsoft Sidewinder X4", ms_sidewinder_macro_fixup),
+};
+
+static bool ms_rdesc_fixup_match(const struct ms_rdesc_fixup *fixup,
+		const __u8 *rdesc, u32 crc)
 {
-	struct input_dev *input = hi->input;
+	unsigned int i;
 
-	switch (usage->hid & HID_USAGE) {
-	case 0xfd06: ms_map_key_clear(KEY_CHAT);	break;
-	case 0xfd07: ms_map_key_clear(KEY_PHONE);	break;
-	case 0xff05:
-		set_bit(EV_REP, input->evbit);
-		ms_map_key_clear(KEY_F13);
-		set_bit(KEY_F14, input->keybit);
-		set_bit(KEY_F15, input->keybit);
-		set_bit(KEY_F16, input->keybit);
-		set_bit(KEY_F17, input->keybit);
-		set_bit(KEY_F18, input->keybit);
+	if (fixup->crc32 && fixup->crc32 != crc)
+		return false;
+
+	for (i = 0; i < fixup->count; i++) {
+		if (rdesc[fixup->patches[i].offset] != fixup->patches[i].expected)
+			return false;
+	}
+	return true;
+}
+
+/* Apply the first of the @count @fixups matching the descriptor */
+static const __u8 *__ms_report_fixup(struct hid_device *hdev, __u8 *rdesc,
+		unsigned int *rsize, const struct ms_rdesc_fixup *fixups,
+		unsigned int count)
+{
+	const struct ms_rdesc_fixup *fixup;
+	const __u8 *ret = rdesc;
+	bool known_size = false, crc_done = false, fixed = false;
+	u32 crc = 0;
+	unsigned int i;
+
+	for (fixup = fixups; fixup < fixups + count; fixup++) {
+		if (fixup->vendor != hdev->vendor || fixup->product != hdev->product ||
+				(fixup->size && fixup->size != *rsize))
+			continue;
+
+		/* Only checksum descriptors that have a candidate */
+		if (!crc_done && (fixup->size || fixup->crc32)) {
+			crc = ~crc32_le(~0, rdesc, *rsize);
+			crc_done = true;
+		}
+		if (fixup->size)
+			known_size = true;
+
+		if (!ms_rdesc_fixup_match(fixup, rdesc, crc))
+			continue;
+
+		if (fixup->count)
+			hid_info(hdev, "fixing up %s report descriptor\n", fixup->name);
+		for (i = 0; i < fixup->count; i++)
+			rdesc[fixup->patches[i].offset] = fixup->patches[i].value;
+		if (fixup->rewrite)
+			ret = fixup->rewrite(hdev, rdesc, rsize);
+		fixed = true;
 		break;
-	default:
-		return 0;
 	}
-	return 1;
+
+	/* Same size but different content: most likely another firmware */
+	if (known_size && !fixed)
+		hid_warn(hdev, "unknown report descriptor revision (size %u, crc32 %08x), not fixing it up\n",
+				*rsize, crc);
+
+	return ret;
 }
 
-static int ms_presenter_8k_quirk(struct hid_input *hi, struct hid_usage *usage,
-		unsigned long **bit, int *max)
+static const __u8 *ms_report_fixup(struct hid_device *hdev, __u8 *rdesc,
+		unsigned int *rsize)
 {
-	set_bit(EV_REP, hi->input->evbit);
-	switch (usage->hid & HID_USAGE) {
-	case 0xfd08: ms_map_key_clear(KEY_FORWARD);	break;
-	case 0xfd09: ms_map_key_clear(KEY_BACK);	break;
-	case 0xfd0b: ms_map_key_clear(KEY_PLAYPAUSE);	break;
-	case 0xfd0e: ms_map_key_clear(KEY_CLOSE);	break;
-	case 0xfd0f: ms_map_key_clear(KEY_PLAY);	break;
-	default:
-		return 0;
+	return __ms_report_fixup(hdev, rdesc, rsize, ms_rdesc_fixups,
+			ARRAY_SIZE(ms_rdesc_fixups));
+}
+
+/*
+ * Vendor usages handled for each device family. Each family is a single
+ * list, expanded into a sorted table of single usages and at most one
+ * contiguous range, which is looked up by index. The single usages of
+ * each list must be in ascending order, for bsearch(), which the build
+ * checks.
+ * key(usage, keycode, kind), range(first usage, last usage, first keycode,
+ * kind)
+ */
+enum {
+	MS_USAGE_NONE,
+	MS_USAGE_KEY,		/* left to hid-input */
+	MS_USAGE_FAVORITES,	/* F14 - F18 bitmask, ergonomy */
+	MS_USAGE_MACRO,		/* S1 - S30 */
+	MS_USAGE_MACRO_BITMAP,	/* S1 - S30 as one field, see ms_report_fixup() */
+	MS_USAGE_MACRO_PAD,
+	MS_USAGE_RECORD,
+	MS_USAGE_PROFILE,
+};
+
+#define MS_ERGONOMY_USAGES(key, range)					\
+	key(0xfd06, KEY_CHAT, MS_USAGE_KEY)				\
+	key(0xfd07, KEY_PHONE, MS_USAGE_KEY)				\
+	key(0xff05, KEY_F13, MS_USAGE_FAVORITES)
+
+#define MS_PRESENTER_USAGES(key, range)					\
+	key(0xfd08, KEY_FORWARD, MS_USAGE_KEY)				\
+	key(0xfd09, KEY_BACK, MS_USAGE_KEY)				\
+	key(0xfd0b, KEY_PLAYPAUSE, MS_USAGE_KEY)			\
+	key(0xfd0e, KEY_CLOSE, MS_USAGE_KEY)				\
+	key(0xfd0f, KEY_PLAY, MS_USAGE_KEY)
+
+/*
+ * Sidewinder X4 / X6 special keys. S1 - S6 macro keys are shared between
+ * Sidewinder X4 & X6 and are programmable, S7 - S30 are only present on
+ * the X6. Profile, Game Center (X6 only) and Macro Key are not
+ * programmable.
+ */
+#define MS_SIDEWINDER_USAGES(key, range)				\
+	key(0xfb00, KEY_MACRO1, MS_USAGE_MACRO_BITMAP)			\
+	range(0xfb01, 0xfb1e, KEY_MACRO1, MS_USAGE_MACRO)		\
+	key(0xfd11, KEY_KBD_LAYOUT_NEXT, MS_USAGE_MACRO_PAD)		\
+	key(0xfd12, KEY_MACRO, MS_USAGE_RECORD)				\
+	key(0xfd15, KEY_MACRO_PRESET_CYCLE, MS_USAGE_PROFILE)
+
+struct ms_usage {
+	__u16 usage;
+	__u16 code;
+	__u8 kind;
+};
+
+/*
+ * @repeat: enable key repeat on every input device with a mapped usage.
+ */
+struct ms_usage_table {
+	const struct ms_usage *usages;
+	unsigned int count;
+	__u16 range_first;
+	__u16 range_count;
+	__u16 range_code;
+	__u8 range_kind;
+	bool repeat;
+};
+
+#define MS_USAGE_ENTRY(u, c, k)		{ .usage = (u), .code = (c), .kind = (k) },
+#define MS_USAGE_NO_ENTRY(u, c, k)
+#define MS_USAGE_RANGE(f, l, c, k)	.range_first = (f),		\
+					.range_count = (l) - (f) + 1,	\
+					.range_code = (c),		\
+					.range_kind = (k),
+#define MS_USAGE_NO_RANGE(f, l, c, k)
+
+/* (-1 < u1) && (u1 < u2) && ... && (un < 0x10000) */
+#define MS_USAGE_ORDER(u, c, k)		(u)) && ((u) <
+#define MS_USAGE_SORTED(list)						\
+	((-1 < list(MS_USAGE_ORDER, MS_USAGE_NO_RANGE) 0x10000))
+
+#define MS_USAGE_TABLE(name, list, rep)					\
+static_assert(MS_USAGE_SORTED(list), #list " not in ascending order");	\
+static const struct ms_usage name##_usages[] = {			\
+	list(MS_USAGE_ENTRY, MS_USAGE_NO_RANGE)				\
+};									\
+static const struct ms_usage_table name##_table = {			\
+	.usages = name##_usages,					\
+	.count = ARRAY_SIZE(name##_usages),				\
+	.repeat = rep,							\
+	list(MS_USAGE_NO_ENTRY, MS_USAGE_RANGE)				\
+}
+
+MS_USAGE_TABLE(ms_ergonomy, MS_ERGONOMY_USAGES, false);
+MS_USAGE_TABLE(ms_presenter, MS_PRESENTER_USAGES, true);
+MS_USAGE_TABLE(ms_sidewinder, MS_SIDEWINDER_USAGES, true);
+
+static const struct ms_usage_table *ms_usage_table(unsigned long quirks)
+{
+	if (quirks & MS_ERGONOMY)
+		return &ms_ergonomy_table;
+	if (quirks & MS_PRESENTER)
+		return &ms_presenter_table;
+	if (quirks & MS_SIDEWINDER)
+		return &ms_sidewinder_table;
+	return NULL;
+}
+
+static int ms_usage_cmp(const void *key, const void *elt)
+{
+	const struct ms_usage *entry = elt;
+
+	return (int)*(const __u16 *)key - entry->usage;
+}
+
+/*
+ * Find a vendor usage of the device family. Returns its kind, and sets
+ * @code to its default keycode and @index to its position in the range,
+ * if it is part of it.
+ */
+static unsigned int ms_usage_lookup(const struct ms_usage_table *table,
+		unsigned int hid, unsigned int *code, unsigned int *index)
+{
+	const struct ms_usage *entry;
+	__u16 usage = hid & HID_USAGE;
+	unsigned int i;
+
+	if (!table || (hid & HID_USAGE_PAGE) != HID_UP_MSVENDOR)
+		return MS_USAGE_NONE;
+
+	i = usage - table->range_first;
+	if (i < table->range_count) {
+		*code = table->range_code + i;
+		*index = i;
+		return table->range_kind;
 	}
-	return 1;
+
+	entry = bsearch(&usage, table->usages, table->count,
+			sizeof(struct ms_usage), ms_usage_cmp);
+	if (!entry)
+		return MS_USAGE_NONE;
+
+	*code = entry->code;
+	*index = 0;
+	return entry->kind;
 }
 
-static int ms_sidewinder_kb_quirk(struct hid_input *hi, struct hid_usage *usage,
-		unsigned long **bit, int *max)
+/*
+ * Remember where a S1 - S30 key lives in its report, so ms_raw_event() can
+ * decode all of them at once. Only single bit variable fields of a single
+ * report are handled that way, anything else is left to ms_event().
+ */
+static void ms_sidewinder_map_macro(struct ms_sidewinder_extra *sidewinder,
+		struct hid_input *hi, struct hid_field *field,
+		struct hid_usage *usage, unsigned int i)
 {
-	set_bit(EV_REP, hi->input->evbit);
-	switch (usage->hid & HID_USAGE) {
-	/*
-	 * Registering Sidewinder X4 / X6 special keys. S1 - S6 macro keys
-	 * are shared between Sidewinder X4 & X6 and are programmable.
-	 */
-	case 0xfb01: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S1 */
-	case 0xfb02: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S2 */
-	case 0xfb03: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S3 */
-	case 0xfb04: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S4 */
-	case 0xfb05: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S5 */
-	case 0xfb06: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S6 */
-	/* S7 - S30 macro keys are only present on the Sidewinder X6 */
-	case 0xfb07: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S7 */
-	case 0xfb08: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S8 */
-	case 0xfb09: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S9 */
-	case 0xfb0a: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S10 */
-	case 0xfb0b: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S11 */
-	case 0xfb0c: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S12 */
-	case 0xfb0d: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S13 */
-	case 0xfb0e: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S14 */
-	case 0xfb0f: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S15 */
-	case 0xfb10: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S16 */
-	case 0xfb11: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S17 */
-	case 0xfb12: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S18 */
-	case 0xfb13: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S19 */
-	case 0xfb14: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S20 */
-	case 0xfb15: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S21 */
-	case 0xfb16: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S22 */
-	case 0xfb17: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S23 */
-	case 0xfb18: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S24 */
-	case 0xfb19: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S25 */
-	case 0xfb1a: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S26 */
-	case 0xfb1b: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S27 */
-	case 0xfb1c: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S28 */
-	case 0xfb1d: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S29 */
-	case 0xfb1e: ms_map_key_clear(KEY_UNKNOWN);	break;	/* S30 */
-	/* Not programmable keys: Profile, Game Center (X6 only) and Macro Key */
-	case 0xfd11: ms_map_key_clear(KEY_UNKNOWN);	break;	/* X6 only: Macro Pad toggle key*/
-	case 0xfd12: ms_map_key_clear(KEY_MACRO);	break;	/* Macro Record key */
-	case 0xfd15: ms_map_key_clear(KEY_UNKNOWN);	break;	/* Profile switch key */
-	default:
-		return 0;
+	sidewinder->input = hi->input;
+	sidewinder->macro_usage[i] = usage;
+
+	if (!(field->flags & HID_MAIN_ITEM_VARIABLE) || field->report_size != 1)
+		return;
+
+	if (sidewinder->macro_keys && sidewinder->macro_report != field->report->id)
+		return;
+
+	sidewinder->macro_report = field->report->id;
+	sidewinder->macro_offset[i] = field->report_offset + usage->usage_index;
+	set_bit(i, &sidewinder->macro_keys);
+}
+
+/*
+ * Same for the single field ms_sidewinder_macro_fixup() made of the keys,
+ * one bit per key from S1 on. With no usage per key, their default keycodes
+ * come from @macro_code instead, see ms_sidewinder_getkeycode().
+ */
+static void ms_sidewinder_map_macro_bitmap(struct ms_sidewinder_extra *sidewinder,
+		struct hid_input *hi, struct hid_field *field)
+{
+	unsigned int i;
+
+	sidewinder->input = hi->input;
+	if (sidewinder->macro_keys || !(field->flags & HID_MAIN_ITEM_VARIABLE) ||
+			field->report_count != 1)
+		return;
+
+	sidewinder->macro_report = field->report->id;
+	sidewinder->macro_bitmap = true;
+	for (i = 0; i < min_t(unsigned int, field->report_size,
+			MS_SIDEWINDER_MACRO_KEYS); i++) {
+		sidewinder->macro_offset[i] = field->report_offset + i;
+		set_bit(i, &sidewinder->macro_keys);
+		set_bit(sidewinder->macro_code[i], hi->input->keybit);
+	}
+}
+
+static const char * const ms_sidewinder_notify_names[] = {
+	[MS_SIDEWINDER_NOTIFY_KEY_MASK] = "key_mask",
+	[MS_SIDEWINDER_NOTIFY_PROFILE] = "profile",
+	[MS_SIDEWINDER_NOTIFY_RECORD] = "record_led",
+	[MS_SIDEWINDER_NOTIFY_AUTO] = "auto_led",
+};
+
+static unsigned int ms_sidewinder_profile(struct ms_sidewinder_extra *sidewinder)
+{
+	return FIELD_GET(MS_SIDEWINDER_STATE_PROFILE, atomic64_read(&sidewinder->state));
+}
+
+static __u8 ms_sidewinder_status(struct ms_sidewinder_extra *sidewinder)
+{
+	return FIELD_GET(MS_SIDEWINDER_STATE_STATUS, atomic64_read(&sidewinder->state));
+}
+
+static unsigned long ms_sidewinder_key_mask(struct ms_sidewinder_extra *sidewinder)
+{
+	return FIELD_GET(MS_SIDEWINDER_STATE_KEY_MASK, atomic64_read(&sidewinder->state));
+}
+
+/* Unpack @state into its user-space layout */
+static void ms_sidewinder_state_unpack(u64 state, struct ms_sidewinder_state *st)
+{
+	__u8 status = FIELD_GET(MS_SIDEWINDER_STATE_STATUS, state);
+
+	memset(st, 0, sizeof(*st));
+	st->generation = FIELD_GET(MS_SIDEWINDER_STATE_GENERATION, state);
+	st->key_mask = FIELD_GET(MS_SIDEWINDER_STATE_KEY_MASK, state);
+	st->profile = FIELD_GET(MS_SIDEWINDER_STATE_PROFILE, state);
+	st->auto_led = (status & 0x02) >> 1;
+	st->record_led = (status & 0x60) >> 5;
+	st->macro_pad = status & 0x01;
+}
+
+/*
+ * Copy the state to the page mapped by user space. Racing updaters are
+ * serialized, and whoever comes last copies the latest state, so the page
+ * never goes back to an older generation.
+ */
+static void ms_sidewinder_state_publish(struct ms_sidewinder_extra *sidewinder)
+{
+	struct ms_sidewinder_ring *ring = READ_ONCE(sidewinder->ring);
+	struct ms_sidewinder_state_page *page;
+	unsigned long flags;
+
+	if (!ring)
+		return;
+
+	page = ring->state;
+	spin_lock_irqsave(&ring->state_lock, flags);
+	WRITE_ONCE(page->seq, page->seq + 1);
+	smp_wmb();
+	page->time = ktime_get_ns();
+	ms_sidewinder_state_unpack(atomic64_read(&sidewinder->state), &page->state);
+	smp_wmb();
+	WRITE_ONCE(page->seq, page->seq + 1);
+	spin_unlock_irqrestore(&ring->state_lock, flags);
+}
+
+/*
+ * Replace the @clear bits of the state by @set, flip the @toggle bits and
+ * bump the generation, unless nothing changes. Returns the old state.
+ */
+static u64 ms_sidewinder_update(struct ms_sidewinder_extra *sidewinder,
+		u64 clear, u64 set, u64 toggle)
+{
+	s64 old = atomic64_read(&sidewinder->state);
+	u64 new;
+
+	do {
+		new = ((old & ~clear) | set) ^ toggle;
+		if (new == old)
+			break;
+		/* The generation is at the top, so it simply wraps around */
+		new += FIELD_PREP(MS_SIDEWINDER_STATE_GENERATION, 1);
+	} while (!atomic64_try_cmpxchg(&sidewinder->state, &old, new));
+
+	if (new != old)
+		ms_sidewinder_state_publish(sidewinder);
+
+	return old;
+}
+
+/* Wake up pollers of every sysfs attribute that changed since last time */
+static void ms_sidewinder_notify(struct ms_sidewinder_extra *sidewinder)
+{
+	unsigned long notify = xchg(&sidewinder->notify, 0);
+	unsigned int i;
+
+	for_each_set_bit(i, &notify, MS_SIDEWINDER_NOTIFY_MAX) {
+		if (sidewinder->kn[i])
+			sysfs_notify_dirent(sidewinder->kn[i]);
 	}
-	return 1;
 }
-#undef ms_map_key_clear
 
-static int ms_sidewinder_control(struct hid_device *hdev, __u8 setup)
+static void ms_sidewinder_led_work(struct work_struct *work)
 {
+	struct ms_sidewinder_extra *sidewinder = container_of(to_delayed_work(work),
+			struct ms_sidewinder_extra, led_work);
+	struct hid_device *hdev = sidewinder->hdev;
 	struct ms_data *sc = hid_get_drvdata(hdev);
-	struct ms_sidewinder_extra *sidewinder = sc->extra;
 	struct hid_report *report =
 			hdev->report_enum[HID_FEATURE_REPORT].report_id_hash[7];
+	ktime_t requested = atomic64_xchg(&sidewinder->led_requested, 0);
+	__u8 setup = ms_sidewinder_status(sidewinder);
+
+	if (!report)
+		return;
+
+	/*
+	 * Check if there are any changes, in order to avoid unnecessary
+	 * setup packets. Both, the Sidewinder X4 and X6, have identical
+	 * USB communication.
+	 */
+	if (setup == sidewinder->led_sent) {
+		atomic_long_inc(&sidewinder->led_dropped);
+		return;
+	}
 
 	/*
 	 * LEDs 1 - 3 should not be set simultaneously, however
@@ -195,293 +937,1855 @@ static int ms_sidewinder_control(struct hid_device *hdev, __u8 setup)
 	case 0x20: report->field[1]->value[0] = 0x03;	break;	/* Record LED Solid */
 	}
 
-	/*
-	 * Check if there are any changes, in order to avoid unnecessary
-	 * setup packets. Both, the Sidewinder X4 and X6, have identical
-	 * USB communication.
-	 */
-	if (sidewinder->status != setup) {
-		hid_hw_request(hdev, report, HID_REQ_SET_REPORT);
-		sidewinder->status = setup;
+	trace_ms_set_report_submit(hdev, setup,
+			ktime_to_ns(ktime_sub(ktime_get(), requested)));
+	hid_hw_request(hdev, report, HID_REQ_SET_REPORT);
+	ms_stat_inc(sc, MS_STAT_SET_REPORT_ISSUED);
+	hid_hw_wait(hdev);
+	trace_ms_set_report_complete(hdev, setup,
+			ktime_to_ns(ktime_sub(ktime_get(), requested)));
+	if (requested)
+		ms_latency_add(&sc->led_latency, requested);
+	sidewinder->led_sent = setup;
+	WRITE_ONCE(sidewinder->led_last, ktime_get());
+	atomic_long_inc(&sidewinder->led_issued);
+}
+
+/* Time left until the next SET_REPORT slot, honouring led_rate */
+static unsigned long ms_sidewinder_led_delay(struct ms_sidewinder_extra *sidewinder)
+{
+	unsigned int rate = READ_ONCE(sidewinder->led_rate);
+	s64 wait;
+
+	if (!rate)
+		return 0;
+
+	wait = NSEC_PER_SEC / rate - ktime_to_ns(ktime_sub(ktime_get(),
+			READ_ONCE(sidewinder->led_last)));
+
+	return wait > 0 ? nsecs_to_jiffies(wait) : 0;
+}
+
+/*
+ * Publish the new LED / numpad state. It is sent to the keyboard later on
+ * by ms_sidewinder_led_work(), which only ever sends the latest state and
+ * at most led_rate times a second. Updates made while one is pending are
+ * merged into it. @clear, @set and @toggle are state bits, so the profile
+ * can change along with its LEDs.
+ */
+static int __ms_sidewinder_control(struct hid_device *hdev, u64 clear, u64 set,
+		u64 toggle)
+{
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	u64 old = ms_sidewinder_update(sidewinder, clear, set, toggle);
+	__u8 changed = FIELD_GET(MS_SIDEWINDER_STATE_STATUS,
+			old ^ (((old & ~clear) | set) ^ toggle));
+	unsigned long flags;
+
+	if (!changed) {
+		ms_stat_inc(sc, MS_STAT_SET_REPORT_SKIPPED);
+		return 0;
+	}
+
+	if (changed & 0x1c)
+		set_bit(MS_SIDEWINDER_NOTIFY_PROFILE, &sidewinder->notify);
+	if (changed & 0x60)
+		set_bit(MS_SIDEWINDER_NOTIFY_RECORD, &sidewinder->notify);
+	if (changed & 0x02)
+		set_bit(MS_SIDEWINDER_NOTIFY_AUTO, &sidewinder->notify);
+	atomic64_cmpxchg(&sidewinder->led_requested, 0, ktime_get());
+
+	spin_lock_irqsave(&sidewinder->led_lock, flags);
+	if (!sidewinder->led_dead && !schedule_delayed_work(&sidewinder->led_work,
+			ms_sidewinder_led_delay(sidewinder)))
+		atomic_long_inc(&sidewinder->led_merged);
+	spin_unlock_irqrestore(&sidewinder->led_lock, flags);
+
+	return 0;
+}
+
+/* Clear the @clear status bits and set @set */
+static int ms_sidewinder_control(struct hid_device *hdev, __u8 clear, __u8 set)
+{
+	return __ms_sidewinder_control(hdev,
+			FIELD_PREP(MS_SIDEWINDER_STATE_STATUS, clear),
+			FIELD_PREP(MS_SIDEWINDER_STATE_STATUS, set), 0);
+}
+
+/* Flip the @toggle status bits, in one go with any concurrent update */
+static int ms_sidewinder_toggle(struct hid_device *hdev, __u8 toggle)
+{
+	return __ms_sidewinder_control(hdev, 0, 0,
+			FIELD_PREP(MS_SIDEWINDER_STATE_STATUS, toggle));
+}
+
+/* Switch to @profile, its LED and its keymap */
+static void ms_sidewinder_set_profile(struct hid_device *hdev,
+		unsigned int profile)
+{
+	__ms_sidewinder_control(hdev, MS_SIDEWINDER_STATE_PROFILE |
+			FIELD_PREP(MS_SIDEWINDER_STATE_STATUS, 0x1c),	/* Clear Profile LEDs */
+			FIELD_PREP(MS_SIDEWINDER_STATE_PROFILE, profile) |
+			FIELD_PREP(MS_SIDEWINDER_STATE_STATUS, 0x02 << profile), 0);
+}
+
+/* Replace one keymap entry, never called from the event path */
+static int ms_sidewinder_set_keycode(struct ms_sidewinder_extra *sidewinder,
+		unsigned int profile, unsigned int key, unsigned int code)
+{
+	struct ms_sidewinder_keymap *old, *new;
+
+	new = kmalloc(sizeof(struct ms_sidewinder_keymap), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	mutex_lock(&sidewinder->keymap_lock);
+	old = rcu_dereference_protected(sidewinder->keymap[profile - 1],
+			lockdep_is_held(&sidewinder->keymap_lock));
+	memcpy(new->code, old->code, sizeof(new->code));
+	new->code[key] = code;
+	rcu_assign_pointer(sidewinder->keymap[profile - 1], new);
+	mutex_unlock(&sidewinder->keymap_lock);
+
+	if (code && sidewinder->input)
+		set_bit(code, sidewinder->input->keybit);
+
+	kfree_rcu(old, rcu);
+	return 0;
+}
+
+/*
+ * Send the keycode of a S1 - S30 key transition, if any. The caller is
+ * responsible for input_sync().
+ */
+static void ms_sidewinder_emit_key(struct ms_sidewinder_extra *sidewinder,
+		unsigned int key, int value)
+{
+	struct ms_sidewinder_keymap *keymap;
+	unsigned int profile, code;
+	unsigned long flags;
+
+	if (!sidewinder->input)
+		return;
+
+	spin_lock_irqsave(&sidewinder->key_lock, flags);
+	if (value) {
+		/* Profile 0 is the state before the first switch */
+		profile = ms_sidewinder_profile(sidewinder);
+		rcu_read_lock();
+		keymap = rcu_dereference(sidewinder->keymap[profile ? profile - 1 : 0]);
+		code = keymap->code[key];
+		rcu_read_unlock();
+
+		__clear_bit(key, &sidewinder->key_default);
+		if (!code && sidewinder->emit_keys) {
+			code = sidewinder->macro_usage[key] ?
+					READ_ONCE(sidewinder->macro_usage[key]->code) :
+					READ_ONCE(sidewinder->macro_code[key]);
+			__set_bit(key, &sidewinder->key_default);
+		}
+		sidewinder->key_code[key] = code;
+	} else {
+		code = sidewinder->key_code[key];
+		sidewinder->key_code[key] = 0;
+		__clear_bit(key, &sidewinder->key_default);
+	}
+
+	if (code)
+		ms_input_event(sidewinder->hdev, sidewinder->input, EV_KEY,
+				code, value);
+	spin_unlock_irqrestore(&sidewinder->key_lock, flags);
+}
+
+/* Every sysfs store rejecting its input goes through here */
+static ssize_t ms_sidewinder_invalid(struct hid_device *hdev)
+{
+	struct ms_data *sc = hid_get_drvdata(hdev);
+
+	ms_stat_inc(sc, MS_STAT_STORE_INVALID);
+	return -EINVAL;
+}
+
+/*
+ * Sidewinder sysfs
+ * @key_mask: show pressed special keys
+ * @profile: show and set profile count and LED status
+ * @auto_led: show and set LED Auto
+ * @record_led: show and set Record LED
+ * @macro_keys: show and set whether special keys are reported as input events
+ * @led_rate: show and set the maximum number of LED updates per second
+ * @led_stats: show the number of issued, merged and dropped LED updates
+ * @keymap: show the S1 - S30 keycodes of all profiles, one line each, set
+ * one of them by writing "<profile> <S key> <keycode>"
+ * @state: binary struct ms_sidewinder_state, read all of the above and
+ * set profile and LEDs at once
+ */
+static ssize_t ms_sidewinder_key_mask_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+
+	return snprintf(buf, PAGE_SIZE, "%lu\n", ms_sidewinder_key_mask(sidewinder));
+}
+
+static struct device_attribute dev_attr_ms_sidewinder_key_mask = {
+	.attr = { .name = __stringify(key_mask), .mode = S_IRUGO },
+	.show = ms_sidewinder_key_mask_show
+};
+
+static ssize_t ms_sidewinder_profile_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+
+	return snprintf(buf, PAGE_SIZE, "%1u\n", ms_sidewinder_profile(sidewinder));
+}
+
+static ssize_t ms_sidewinder_profile_store(struct device *dev,
+		struct device_attribute *attr, char const *buf, size_t count)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	unsigned int profile;
+
+	if (sscanf(buf, "%1u", &profile) != 1)
+		return ms_sidewinder_invalid(hdev);
+
+	if (profile >= 1 && profile <= 3) {
+		ms_sidewinder_set_profile(hdev, profile);
+		ms_sidewinder_notify(sidewinder);
+		return strnlen(buf, PAGE_SIZE);
+	} else
+		return ms_sidewinder_invalid(hdev);
+}
+
+static struct device_attribute dev_attr_ms_sidewinder_profile =
+	__ATTR(profile, S_IWUSR | S_IRUGO,
+		ms_sidewinder_profile_show,
+		ms_sidewinder_profile_store);
+
+static ssize_t ms_sidewinder_record_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+
+	return snprintf(buf, PAGE_SIZE, "%1d\n", (ms_sidewinder_status(sidewinder) & 0x60) >> 5);
+}
+
+static ssize_t ms_sidewinder_record_store(struct device *dev,
+		struct device_attribute *attr, char const *buf, size_t count)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	unsigned int record_led;
+
+	if (sscanf(buf, "%1d", &record_led) != 1)
+		return ms_sidewinder_invalid(hdev);
+
+	if (record_led >= 0 && record_led <= 2) {
+		/* Clear Record LED, then set it */
+		ms_sidewinder_control(hdev, 0xe0, record_led ? 0x10 << record_led : 0);
+		ms_sidewinder_notify(sidewinder);
+		return strnlen(buf, PAGE_SIZE);
+	} else
+		return ms_sidewinder_invalid(hdev);
+}
+
+static struct device_attribute dev_attr_ms_sidewinder_record =
+	__ATTR(record_led, S_IWUSR | S_IRUGO,
+		ms_sidewinder_record_show,
+		ms_sidewinder_record_store);
+
+static ssize_t ms_sidewinder_auto_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+
+	return snprintf(buf, PAGE_SIZE, "%1d\n", (ms_sidewinder_status(sidewinder) & 0x02) >> 1);	/* Check if Auto LED bit is set */
+}
+
+static ssize_t ms_sidewinder_auto_store(struct device *dev,
+		struct device_attribute *attr, char const *buf, size_t count)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	unsigned int auto_led;
+
+	if (sscanf(buf, "%1d", &auto_led) != 1)
+		return ms_sidewinder_invalid(hdev);
+
+	if (auto_led == 0 || auto_led == 1) {
+		/* Clear Auto LED, then set it */
+		ms_sidewinder_control(hdev, 0x02, auto_led ? 0x02 : 0);
+		ms_sidewinder_notify(sidewinder);
+		return strnlen(buf, PAGE_SIZE);
+	} else
+		return ms_sidewinder_invalid(hdev);
+}
+
+static struct device_attribute dev_attr_ms_sidewinder_auto =
+	__ATTR(auto_led, S_IWUSR | S_IRUGO,
+		ms_sidewinder_auto_show,
+		ms_sidewinder_auto_store);
+
+static ssize_t ms_sidewinder_macro_keys_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+
+	return snprintf(buf, PAGE_SIZE, "%1d\n", sidewinder->emit_keys);
+}
+
+static ssize_t ms_sidewinder_macro_keys_store(struct device *dev,
+		struct device_attribute *attr, char const *buf, size_t count)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	unsigned int emit_keys;
+	unsigned long flags;
+	unsigned int i;
+
+	if (sscanf(buf, "%1u", &emit_keys) != 1 || emit_keys > 1)
+		return ms_sidewinder_invalid(hdev);
+
+	spin_lock_irqsave(&sidewinder->key_lock, flags);
+	/* Release held keys, so nothing gets stuck when turning this off */
+	if (!emit_keys && sidewinder->key_default && sidewinder->input) {
+		for_each_set_bit(i, &sidewinder->key_default, MS_SIDEWINDER_MACRO_KEYS) {
+			input_event(sidewinder->input, EV_KEY,
+					sidewinder->key_code[i], 0);
+			sidewinder->key_code[i] = 0;
+		}
+		sidewinder->key_default = 0;
+		input_sync(sidewinder->input);
+	}
+	sidewinder->emit_keys = emit_keys;
+	spin_unlock_irqrestore(&sidewinder->key_lock, flags);
+
+	return strnlen(buf, PAGE_SIZE);
+}
+
+static struct device_attribute dev_attr_ms_sidewinder_macro_keys =
+	__ATTR(macro_keys, S_IWUSR | S_IRUGO,
+		ms_sidewinder_macro_keys_show,
+		ms_sidewinder_macro_keys_store);
+
+static ssize_t ms_sidewinder_led_rate_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", sidewinder->led_rate);
+}
+
+static ssize_t ms_sidewinder_led_rate_store(struct device *dev,
+		struct device_attribute *attr, char const *buf, size_t count)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	unsigned int rate;
+
+	if (kstrtouint(buf, 10, &rate) || rate > 1000)
+		return ms_sidewinder_invalid(hdev);
+
+	WRITE_ONCE(sidewinder->led_rate, rate);
+	return strnlen(buf, PAGE_SIZE);
+}
+
+static struct device_attribute dev_attr_ms_sidewinder_led_rate =
+	__ATTR(led_rate, S_IWUSR | S_IRUGO,
+		ms_sidewinder_led_rate_show,
+		ms_sidewinder_led_rate_store);
+
+static ssize_t ms_sidewinder_led_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+
+	return snprintf(buf, PAGE_SIZE, "%lu %lu %lu\n",
+			atomic_long_read(&sidewinder->led_issued),
+			atomic_long_read(&sidewinder->led_merged),
+			atomic_long_read(&sidewinder->led_dropped));
+}
+
+static struct device_attribute dev_attr_ms_sidewinder_led_stats = {
+	.attr = { .name = __stringify(led_stats), .mode = S_IRUGO },
+	.show = ms_sidewinder_led_stats_show
+};
+
+static ssize_t ms_sidewinder_keymap_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	struct ms_sidewinder_keymap *keymap;
+	ssize_t len = 0;
+	int p, i;
+
+	rcu_read_lock();
+	for (p = 0; p < MS_SIDEWINDER_PROFILES; p++) {
+		keymap = rcu_dereference(sidewinder->keymap[p]);
+		for (i = 0; i < MS_SIDEWINDER_MACRO_KEYS; i++)
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%u%c",
+					keymap->code[i],
+					i < MS_SIDEWINDER_MACRO_KEYS - 1 ? ' ' : '\n');
+	}
+	rcu_read_unlock();
+
+	return len;
+}
+
+static ssize_t ms_sidewinder_keymap_store(struct device *dev,
+		struct device_attribute *attr, char const *buf, size_t count)
+{
+	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	unsigned int profile, key, code;
+	int ret;
+
+	if (sscanf(buf, "%u %u %u", &profile, &key, &code) != 3)
+		return ms_sidewinder_invalid(hdev);
+
+	if (profile < 1 || profile > MS_SIDEWINDER_PROFILES ||
+			key < 1 || key > MS_SIDEWINDER_MACRO_KEYS || code > KEY_MAX)
+		return ms_sidewinder_invalid(hdev);
+
+	ret = ms_sidewinder_set_keycode(sidewinder, profile, key - 1, code);
+	if (ret)
+		return ret;
+
+	return strnlen(buf, PAGE_SIZE);
+}
+
+static struct device_attribute dev_attr_ms_sidewinder_keymap =
+	__ATTR(keymap, S_IWUSR | S_IRUGO,
+		ms_sidewinder_keymap_show,
+		ms_sidewinder_keymap_store);
+
+static ssize_t ms_sidewinder_state_read(struct file *file,
+		struct kobject *kobj, const struct bin_attribute *attr,
+		char *buf, loff_t off, size_t count)
+{
+	struct hid_device *hdev = container_of(kobj_to_dev(kobj),
+			struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	struct ms_sidewinder_state st;
+
+	ms_sidewinder_state_unpack(atomic64_read(&sidewinder->state), &st);
+	return memory_read_from_buffer(buf, count, &off, &st, sizeof(st));
+}
+
+static ssize_t ms_sidewinder_state_write(struct file *file,
+		struct kobject *kobj, const struct bin_attribute *attr,
+		char *buf, loff_t off, size_t count)
+{
+	struct hid_device *hdev = container_of(kobj_to_dev(kobj),
+			struct hid_device, dev);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	struct ms_sidewinder_state st;
+	__u8 leds;
+
+	if (off || count != sizeof(st))
+		return ms_sidewinder_invalid(hdev);
+
+	memcpy(&st, buf, sizeof(st));
+	if (st.profile < 1 || st.profile > 3 || st.auto_led > 1 ||
+			st.record_led > 2 || st.macro_pad > 1 ||
+			memchr_inv(st.reserved, 0, sizeof(st.reserved)))
+		return ms_sidewinder_invalid(hdev);
+
+	leds = st.macro_pad | (st.auto_led << 1) | (0x02 << st.profile);
+	if (st.record_led)
+		leds |= 0x10 << st.record_led;
+
+	/* Everything but the pressed keys, in one go */
+	__ms_sidewinder_control(hdev, MS_SIDEWINDER_STATE_PROFILE |
+			MS_SIDEWINDER_STATE_STATUS,
+			FIELD_PREP(MS_SIDEWINDER_STATE_PROFILE, st.profile) |
+			FIELD_PREP(MS_SIDEWINDER_STATE_STATUS, leds), 0);
+	ms_sidewinder_notify(sidewinder);
+
+	return count;
+}
+
+static const struct bin_attribute bin_attr_ms_sidewinder_state = {
+	.attr = { .name = __stringify(state), .mode = S_IWUSR | S_IRUGO },
+	.size = sizeof(struct ms_sidewinder_state),
+	.read = ms_sidewinder_state_read,
+	.write = ms_sidewinder_state_write,
+};
+
+static struct attribute *ms_attributes[] = {
+	&dev_attr_ms_sidewinder_key_mask.attr,
+	&dev_attr_ms_sidewinder_profile.attr,
+	&dev_attr_ms_sidewinder_record.attr,
+	&dev_attr_ms_sidewinder_auto.attr,
+	&dev_attr_ms_sidewinder_macro_keys.attr,
+	&dev_attr_ms_sidewinder_led_rate.attr,
+	&dev_attr_ms_sidewinder_led_stats.attr,
+	&dev_attr_ms_sidewinder_keymap.attr,
+	NULL
+};
+
+static const struct bin_attribute *const ms_bin_attributes[] = {
+	&bin_attr_ms_sidewinder_state,
+	NULL
+};
+
+static const struct attribute_group ms_attr_group = {
+	.attrs = ms_attributes,
+	.bin_attrs = ms_bin_attributes,
+};
+
+/*
+ * hid-input only knows the favorites usage as a whole, so its five keys get
+ * scancodes of their own, 0xff05 followed by the bit of the key in the
+ * report (0xff050001 - 0xff050010). That way they can be remapped with
+ * EVIOCSKEYCODE and hwdb like any other key, all other scancodes are left
+ * to hid-input.
+ */
+#define MS_ERGONOMY_SCANCODE(bit)	((0xff05 << 16) | BIT(bit))
+
+/*
+ * Whether any usage in the keymap behind @getkeycode, the one of hid-input,
+ * still sends @keycode. Other usages of the same input device may send the
+ * keycode a remapped key had, so its keybit must stay set for them.
+ */
+static bool ms_keycode_mapped(struct input_dev *input,
+		int (*getkeycode)(struct input_dev *input,
+				struct input_keymap_entry *ke),
+		unsigned int keycode)
+{
+	struct input_keymap_entry ke = { .flags = INPUT_KEYMAP_BY_INDEX };
+
+	for (ke.index = 0; !getkeycode(input, &ke); ke.index++) {
+		if (ke.keycode == keycode)
+			return true;
+	}
+	return false;
+}
+
+static int ms_ergonomy_favorite(const struct input_keymap_entry *ke,
+		unsigned int *scancode)
+{
+	int i;
+
+	if ((ke->flags & INPUT_KEYMAP_BY_INDEX) ||
+			input_scancode_to_scalar(ke, scancode))
+		return -1;
+
+	for (i = 0; i < MS_ERGONOMY_FAVORITES; i++) {
+		if (*scancode == MS_ERGONOMY_SCANCODE(i))
+			return i;
+	}
+	return -1;
+}
+
+static int ms_ergonomy_getkeycode(struct input_dev *input,
+		struct input_keymap_entry *ke)
+{
+	struct hid_device *hdev = input_get_drvdata(input);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_ergonomy_extra *ergonomy = sc->extra;
+	unsigned int scancode;
+	int i = ms_ergonomy_favorite(ke, &scancode);
+
+	if (i < 0)
+		return ergonomy->getkeycode(input, ke);
+
+	ke->keycode = ergonomy->key_code[i];
+	ke->len = sizeof(scancode);
+	memcpy(ke->scancode, &scancode, sizeof(scancode));
+	return 0;
+}
+
+/* Called with the event lock held, so no favorites key is half handled */
+static int ms_ergonomy_setkeycode(struct input_dev *input,
+		const struct input_keymap_entry *ke, unsigned int *old_keycode)
+{
+	struct hid_device *hdev = input_get_drvdata(input);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_ergonomy_extra *ergonomy = sc->extra;
+	unsigned int scancode;
+	int i = ms_ergonomy_favorite(ke, &scancode);
+
+	if (i < 0)
+		return ergonomy->setkeycode(input, ke, old_keycode);
+
+	*old_keycode = ergonomy->key_code[i];
+	WRITE_ONCE(ergonomy->key_code[i], ke->keycode);
+	__set_bit(ke->keycode, input->keybit);
+
+	/* Keep the old keycode if another key still sends it */
+	for (i = 0; i < MS_ERGONOMY_FAVORITES; i++) {
+		if (ergonomy->key_code[i] == *old_keycode)
+			return 0;
+	}
+	if (!ms_keycode_mapped(input, ergonomy->getkeycode, *old_keycode))
+		__clear_bit(*old_keycode, input->keybit);
+	return 0;
+}
+
+/*
+ * Likewise for the S1 - S30 keys of a collapsed bitmap: they keep the
+ * scancodes of the usages they had, 0xff00fb01 - 0xff00fb1e.
+ */
+#define MS_SIDEWINDER_SCANCODE(i)	(HID_UP_MSVENDOR | (0xfb01 + (i)))
+
+static int ms_sidewinder_macro_scancode(struct ms_sidewinder_extra *sidewinder,
+		const struct input_keymap_entry *ke, unsigned int *scancode)
+{
+	unsigned int i;
+
+	if ((ke->flags & INPUT_KEYMAP_BY_INDEX) ||
+			input_scancode_to_scalar(ke, scancode))
+		return -1;
+
+	i = *scancode - MS_SIDEWINDER_SCANCODE(0);
+	if (i >= MS_SIDEWINDER_MACRO_KEYS || !test_bit(i, &sidewinder->macro_keys))
+		return -1;
+	return i;
+}
+
+static int ms_sidewinder_getkeycode(struct input_dev *input,
+		struct input_keymap_entry *ke)
+{
+	struct hid_device *hdev = input_get_drvdata(input);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	unsigned int scancode;
+	int i = ms_sidewinder_macro_scancode(sidewinder, ke, &scancode);
+
+	if (i < 0)
+		return sidewinder->getkeycode(input, ke);
+
+	ke->keycode = sidewinder->macro_code[i];
+	ke->len = sizeof(scancode);
+	memcpy(ke->scancode, &scancode, sizeof(scancode));
+	return 0;
+}
+
+/* Whether the keymap of any profile sends @keycode */
+static bool ms_sidewinder_keymaps_send(struct ms_sidewinder_extra *sidewinder,
+		unsigned int keycode)
+{
+	struct ms_sidewinder_keymap *keymap;
+	bool found = false;
+	unsigned int p, i;
+
+	rcu_read_lock();
+	for (p = 0; p < MS_SIDEWINDER_PROFILES && !found; p++) {
+		keymap = rcu_dereference(sidewinder->keymap[p]);
+		for (i = 0; i < MS_SIDEWINDER_MACRO_KEYS; i++) {
+			if (keymap->code[i] == keycode) {
+				found = true;
+				break;
+			}
+		}
+	}
+	rcu_read_unlock();
+
+	return found;
+}
+
+/* Called with the event lock held, held keys are released by key_code */
+static int ms_sidewinder_setkeycode(struct input_dev *input,
+		const struct input_keymap_entry *ke, unsigned int *old_keycode)
+{
+	struct hid_device *hdev = input_get_drvdata(input);
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	unsigned int scancode;
+	int i = ms_sidewinder_macro_scancode(sidewinder, ke, &scancode);
+
+	if (i < 0)
+		return sidewinder->setkeycode(input, ke, old_keycode);
+
+	*old_keycode = sidewinder->macro_code[i];
+	WRITE_ONCE(sidewinder->macro_code[i], ke->keycode);
+	__set_bit(ke->keycode, input->keybit);
+
+	/*
+	 * Keep the old keycode if another S key, a profile keymap or any
+	 * other usage still sends it
+	 */
+	for (i = 0; i < MS_SIDEWINDER_MACRO_KEYS; i++) {
+		if (sidewinder->macro_code[i] == *old_keycode)
+			return 0;
+	}
+	if (ms_sidewinder_keymaps_send(sidewinder, *old_keycode) ||
+			ms_keycode_mapped(input, sidewinder->getkeycode, *old_keycode))
+		return 0;
+	__clear_bit(*old_keycode, input->keybit);
+	return 0;
+}
+
+/* One bit per key, as found in the NKRO reports of the keyboard interfaces */
+static bool ms_sidewinder_nkro_field(const struct hid_field *field)
+{
+	return field->hidinput && field->report_size == 1 &&
+		(field->flags & HID_MAIN_ITEM_VARIABLE) &&
+		!(field->flags & HID_MAIN_ITEM_CONSTANT) &&
+		field->logical_minimum == 0 &&
+		(field->usage[0].hid & HID_USAGE_PAGE) == HID_UP_KEYBOARD;
+}
+
+/*
+ * Pick the input report with the largest key bitmap, once hid-input mapped
+ * its usages, when configuring the input device its keys go to. That is
+ * before the device is registered, so before any report is decoded. All
+ * bitmap fields of that report are decoded by ms_sidewinder_nkro_event()
+ * from then on, ms_sidewinder_event() claims them so hid-input does not
+ * send their keys a second time.
+ */
+static int ms_sidewinder_nkro_init(struct hid_device *hdev,
+		struct hid_input *hi)
+{
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	struct hid_report_enum *report_enum = &hdev->report_enum[HID_INPUT_REPORT];
+	struct ms_sidewinder_nkro *nkro;
+	struct hid_report *report, *best = NULL;
+	struct input_dev *input = NULL;
+	unsigned int first = UINT_MAX, end = 0, keys = 0, i, n;
+
+	list_for_each_entry(report, &report_enum->report_list, list) {
+		unsigned int count = 0;
+
+		for (i = 0; i < report->maxfield; i++)
+			if (ms_sidewinder_nkro_field(report->field[i]))
+				count += report->field[i]->report_count;
+		if (count > keys) {
+			keys = count;
+			best = report;
+		}
+	}
+
+	if (keys < MS_SIDEWINDER_NKRO_MIN_KEYS)
+		return 0;
+
+	for (i = 0; i < best->maxfield; i++) {
+		struct hid_field *field = best->field[i];
+
+		if (!ms_sidewinder_nkro_field(field))
+			continue;
+		if (input && field->hidinput->input != input) {
+			hid_warn(hdev, "key bitmap spans several input devices, not decoding it\n");
+			return 0;
+		}
+		input = field->hidinput->input;
+		first = min(first, field->report_offset);
+		end = max(end, field->report_offset + field->report_count);
+	}
+
+	if (input != hi->input)
+		return 0;
+
+	if (end - round_down(first, 8) > MS_SIDEWINDER_NKRO_BITS) {
+		hid_warn(hdev, "key bitmap too large, not decoding it\n");
+		return 0;
+	}
+
+	nkro = kzalloc(sizeof(struct ms_sidewinder_nkro), GFP_KERNEL);
+	if (!nkro)
+		return -ENOMEM;
+
+	nkro->report = best;
+	nkro->input = input;
+	nkro->start = first / 8;
+	nkro->bits = end - nkro->start * 8;
+	for (i = 0; i < best->maxfield; i++) {
+		struct hid_field *field = best->field[i];
+
+		if (!ms_sidewinder_nkro_field(field))
+			continue;
+		for (n = 0; n < field->report_count; n++) {
+			unsigned int bit = field->report_offset + n - nkro->start * 8;
+
+			if (field->usage[n].type != EV_KEY)
+				continue;
+			__set_bit(bit, nkro->keys);
+			nkro->usage[bit] = &field->usage[n];
+		}
+	}
+
+	/* Fully set up before the event path can see it */
+	smp_store_release(&sidewinder->nkro, nkro);
+	return 0;
+}
+
+static int ms_input_mapping(struct hid_device *hdev, struct hid_input *hi,
+		struct hid_field *field, struct hid_usage *usage,
+		unsigned long **bit, int *max)
+{
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct input_dev *input = hi->input;
+	unsigned int kind, code, index, i;
+
+	kind = ms_usage_lookup(sc->usages, usage->hid, &code, &index);
+	if (kind == MS_USAGE_NONE)
+		return 0;
+
+	if (sc->usages->repeat)
+		set_bit(EV_REP, input->evbit);
+
+	/* The keys of the bitmap are decoded by ms_raw_event() only */
+	if (kind == MS_USAGE_MACRO_BITMAP) {
+		set_bit(EV_KEY, input->evbit);
+		ms_sidewinder_map_macro_bitmap(sc->extra, hi, field);
+		return -1;
+	}
+
+	hid_map_usage_clear(hi, usage, bit, max, EV_KEY, code);
+
+	switch (kind) {
+	case MS_USAGE_FAVORITES: {
+		struct ms_ergonomy_extra *ergonomy = sc->extra;
+
+		set_bit(EV_REP, input->evbit);
+		for (i = 0; i < MS_ERGONOMY_FAVORITES; i++)
+			set_bit(ergonomy->key_code[i], input->keybit);
+		ergonomy->input = input;
+		break;
+	}
+	case MS_USAGE_MACRO:
+		ms_sidewinder_map_macro(sc->extra, hi, field, usage, index);
+		break;
+	}
+
+	return 1;
+}
+
+static int ms_input_mapped(struct hid_device *hdev, struct hid_input *hi,
+		struct hid_field *field, struct hid_usage *usage,
+		unsigned long **bit, int *max)
+{
+	struct ms_data *sc = hid_get_drvdata(hdev);
+
+	if (sc->quirks & MS_DUPLICATE_USAGES)
+		clear_bit(usage->code, *bit);
+
+	return 0;
+}
+
+/* Setting initial profile and LED of Sidewinder keyboards */
+static void ms_feature_mapping(struct hid_device *hdev,
+		struct hid_field *field, struct hid_usage *usage)
+{
+	struct ms_data *sc = hid_get_drvdata(hdev);
+
+	if (sc->quirks & MS_SIDEWINDER)
+		ms_sidewinder_set_profile(hdev, 1);
+}
+
+static void ms_sidewinder_ring_push(struct ms_sidewinder_extra *sidewinder,
+		unsigned int key, int value)
+{
+	struct ms_sidewinder_ring *ring = READ_ONCE(sidewinder->ring);
+	struct ms_sidewinder_event *ev;
+	__u32 head;
+
+	if (!ring)
+		return;
+
+	head = ring->header->head;
+	ev = &ring->events[head & (MS_SIDEWINDER_RING_EVENTS - 1)];
+	ev->time = ktime_get_ns();
+	ev->key = key;
+	ev->value = !!value;
+	ev->profile = ms_sidewinder_profile(sidewinder);
+
+	/* Publish the event before the new head */
+	smp_store_release(&ring->header->head, head + 1);
+	wake_up_interruptible(&ring->wait);
+}
+
+static void ms_sidewinder_ring_free(struct kref *ref)
+{
+	struct ms_sidewinder_ring *ring =
+			container_of(ref, struct ms_sidewinder_ring, ref);
+
+	vfree(ring->header);
+	kfree(ring);
+}
+
+static int ms_sidewinder_ring_open(struct inode *inode, struct file *file)
+{
+	/* misc_open() stored our miscdevice, under misc_mtx */
+	struct ms_sidewinder_ring *ring = container_of(file->private_data,
+			struct ms_sidewinder_ring, misc);
+	struct ms_sidewinder_reader *reader;
+
+	reader = kzalloc(sizeof(struct ms_sidewinder_reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	kref_get(&ring->ref);
+	reader->ring = ring;
+	reader->tail = smp_load_acquire(&ring->header->head);
+	file->private_data = reader;
+
+	return 0;
+}
+
+static int ms_sidewinder_ring_release(struct inode *inode, struct file *file)
+{
+	struct ms_sidewinder_reader *reader = file->private_data;
+
+	kref_put(&reader->ring->ref, ms_sidewinder_ring_free);
+	kfree(reader);
+
+	return 0;
+}
+
+static ssize_t ms_sidewinder_ring_read(struct file *file, char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	struct ms_sidewinder_reader *reader = file->private_data;
+	struct ms_sidewinder_ring *ring = reader->ring;
+	struct ms_sidewinder_event ev[16];
+	size_t copied = 0;
+	__u32 head;
+	int ret;
+
+	if (count < sizeof(struct ms_sidewinder_event))
+		return -EINVAL;
+
+	while (!copied) {
+		unsigned int n, i;
+
+		head = smp_load_acquire(&ring->header->head);
+		if (head == reader->tail) {
+			if (ring->dead)
+				return 0;
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			ret = wait_event_interruptible(ring->wait, ring->dead ||
+					smp_load_acquire(&ring->header->head) != reader->tail);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		/*
+		 * Skip events that have already been overwritten. The oldest
+		 * slot of a full ring may be rewritten at any time, so skip
+		 * that one as well.
+		 */
+		if (head - reader->tail >= MS_SIDEWINDER_RING_EVENTS)
+			reader->tail = head - MS_SIDEWINDER_RING_EVENTS + 1;
+
+		n = min_t(size_t, head - reader->tail, ARRAY_SIZE(ev));
+		n = min_t(size_t, n, count / sizeof(struct ms_sidewinder_event));
+		for (i = 0; i < n; i++)
+			ev[i] = ring->events[(reader->tail + i) &
+					(MS_SIDEWINDER_RING_EVENTS - 1)];
+
+		/* Drop whatever the producer may have overwritten meanwhile */
+		smp_rmb();
+		head = READ_ONCE(ring->header->head);
+		if (head - reader->tail >= MS_SIDEWINDER_RING_EVENTS)
+			continue;
+
+		if (copy_to_user(buf, ev, n * sizeof(struct ms_sidewinder_event)))
+			return -EFAULT;
+
+		reader->tail += n;
+		copied = n * sizeof(struct ms_sidewinder_event);
+	}
+
+	return copied;
+}
+
+static __poll_t ms_sidewinder_ring_poll(struct file *file, poll_table *wait)
+{
+	struct ms_sidewinder_reader *reader = file->private_data;
+	struct ms_sidewinder_ring *ring = reader->ring;
+	__poll_t mask = 0;
+
+	poll_wait(file, &ring->wait, wait);
+
+	if (smp_load_acquire(&ring->header->head) != reader->tail)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (ring->dead)
+		mask |= EPOLLHUP;
+
+	return mask;
+}
+
+static int ms_sidewinder_ring_mmap(struct file *file,
+		struct vm_area_struct *vma)
+{
+	struct ms_sidewinder_reader *reader = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return remap_vmalloc_range(vma, reader->ring->header, vma->vm_pgoff);
+}
+
+static const struct file_operations ms_sidewinder_ring_fops = {
+	.owner = THIS_MODULE,
+	.open = ms_sidewinder_ring_open,
+	.release = ms_sidewinder_ring_release,
+	.read = ms_sidewinder_ring_read,
+	.poll = ms_sidewinder_ring_poll,
+	.mmap = ms_sidewinder_ring_mmap,
+	.llseek = noop_llseek,
+};
+
+static int ms_sidewinder_ring_create(struct hid_device *hdev)
+{
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	struct ms_sidewinder_ring *ring;
+	size_t events;
+	int ret;
+
+	ring = kzalloc(sizeof(struct ms_sidewinder_ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	/* Header on the first page, then the events, then the state page */
+	events = PAGE_ALIGN(MS_SIDEWINDER_RING_EVENTS *
+			sizeof(struct ms_sidewinder_event));
+	ring->header = vmalloc_user(PAGE_SIZE + events + PAGE_SIZE);
+	if (!ring->header) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+	ring->header->size = MS_SIDEWINDER_RING_EVENTS;
+	ring->header->offset = PAGE_SIZE;
+	ring->header->state_offset = PAGE_SIZE + events;
+	ring->events = (void *)ring->header + PAGE_SIZE;
+	ring->state = (void *)ring->header + PAGE_SIZE + events;
+	spin_lock_init(&ring->state_lock);
+
+	kref_init(&ring->ref);
+	init_waitqueue_head(&ring->wait);
+	snprintf(ring->name, sizeof(ring->name), "sidewinder%u", hdev->id);
+	ring->misc.minor = MISC_DYNAMIC_MINOR;
+	ring->misc.name = ring->name;
+	ring->misc.fops = &ms_sidewinder_ring_fops;
+	ring->misc.parent = &hdev->dev;
+
+	ret = misc_register(&ring->misc);
+	if (ret) {
+		kref_put(&ring->ref, ms_sidewinder_ring_free);
+		return ret;
+	}
+
+	WRITE_ONCE(sidewinder->ring, ring);
+	ms_sidewinder_state_publish(sidewinder);
+	return 0;
+}
+
+static void ms_sidewinder_ring_destroy(struct ms_sidewinder_extra *sidewinder)
+{
+	struct ms_sidewinder_ring *ring = sidewinder->ring;
+
+	if (!ring)
+		return;
+
+	WRITE_ONCE(sidewinder->ring, NULL);
+	misc_deregister(&ring->misc);
+	ring->dead = true;
+	wake_up_interruptible(&ring->wait);
+	kref_put(&ring->ref, ms_sidewinder_ring_free);
+}
+
+/*
+ * Sidewinder macro recorder
+ *
+ * All interfaces of one keyboard share a struct ms_sidewinder_group, so
+ * keys typed on the keyboard interface can be recorded for, and replayed
+ * by, the S1 - S30 keys of the vendor interface.
+ *
+ * Pressing Macro Record arms the recorder (Record LED blinks), the next
+ * S key pressed selects the macro slot in the current profile (Record LED
+ * solid), then every key typed is recorded along with its timing until
+ * Macro Record is pressed again. Recording nothing clears the slot.
+ * Pressing that S key afterwards replays the macro from a hrtimer.
+ *
+ * @users: number of bound interfaces.
+ * @leaving: number of interfaces being unbound. Recording and replaying
+ * stop until they are gone and their events were purged, as recorded
+ * events refer to their input devices.
+ * @rec_keys: keys pressed while recording, to skip repeated values and
+ * to release keys still held when recording stops.
+ * @rec_last: time of the last recorded event.
+ * @play: macro being replayed, @play_pos is the next event to send.
+ */
+#define MS_SIDEWINDER_MACRO_EVENTS	128
+
+enum {
+	MS_SIDEWINDER_REC_IDLE,
+	MS_SIDEWINDER_REC_ARMED,
+	MS_SIDEWINDER_REC_ON,
+};
+
+struct ms_sidewinder_macro_event {
+	struct hid_device *hdev;
+	struct input_dev *input;
+	__u32 delay;	/* us since the previous event */
+	__u16 code;
+	__s32 value;
+};
+
+struct ms_sidewinder_macro {
+	unsigned int count;
+	struct ms_sidewinder_macro_event events[];
+};
+
+struct ms_sidewinder_group {
+	struct list_head node;
+	struct device *parent;
+	unsigned int users;
+	spinlock_t lock;
+	unsigned int leaving;
+	int rec_state;
+	unsigned int rec_profile;
+	unsigned int rec_key;
+	unsigned int rec_count;
+	ktime_t rec_last;
+	DECLARE_BITMAP(rec_keys, KEY_CNT);
+	struct ms_sidewinder_macro_event rec[MS_SIDEWINDER_MACRO_EVENTS];
+	struct ms_sidewinder_macro *macros[MS_SIDEWINDER_PROFILES][MS_SIDEWINDER_MACRO_KEYS];
+	struct hrtimer play_timer;
+	struct ms_sidewinder_macro *play;
+	unsigned int play_pos;
+};
+
+static LIST_HEAD(ms_sidewinder_groups);
+static DEFINE_MUTEX(ms_sidewinder_groups_lock);
+
+static enum hrtimer_restart ms_sidewinder_macro_play(struct hrtimer *timer)
+{
+	struct ms_sidewinder_group *group =
+			container_of(timer, struct ms_sidewinder_group, play_timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	struct ms_sidewinder_macro *macro;
+	unsigned long flags;
+
+	spin_lock_irqsave(&group->lock, flags);
+	macro = group->play;
+
+	/* Send the event the timer was armed for and all following at once */
+	while (macro && group->play_pos < macro->count) {
+		struct ms_sidewinder_macro_event *ev =
+				&macro->events[group->play_pos];
+
+		if (ev->delay && ret == HRTIMER_RESTART) {
+			hrtimer_forward_now(timer, us_to_ktime(ev->delay));
+			break;
+		}
+
+		input_event(ev->input, EV_KEY, ev->code, ev->value);
+		input_sync(ev->input);
+		group->play_pos++;
+		ret = HRTIMER_RESTART;
+	}
+
+	if (!macro || group->play_pos >= macro->count) {
+		group->play = NULL;
+		ret = HRTIMER_NORESTART;
+	}
+	spin_unlock_irqrestore(&group->lock, flags);
+
+	return ret;
+}
+
+static struct ms_sidewinder_group *ms_sidewinder_group_get(struct hid_device *hdev)
+{
+	/* All interfaces of a USB keyboard share the same usb_device */
+	struct device *parent = hid_is_usb(hdev) ? hdev->dev.parent->parent :
+			&hdev->dev;
+	struct ms_sidewinder_group *group;
+
+	mutex_lock(&ms_sidewinder_groups_lock);
+	list_for_each_entry(group, &ms_sidewinder_groups, node) {
+		if (group->parent == parent) {
+			group->users++;
+			goto out;
+		}
+	}
+
+	group = kzalloc(sizeof(struct ms_sidewinder_group), GFP_KERNEL);
+	if (group) {
+		group->parent = parent;
+		group->users = 1;
+		spin_lock_init(&group->lock);
+		hrtimer_setup(&group->play_timer, ms_sidewinder_macro_play,
+				CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+		list_add(&group->node, &ms_sidewinder_groups);
+	}
+out:
+	mutex_unlock(&ms_sidewinder_groups_lock);
+	return group;
+}
+
+/*
+ * Drop the events typed on @hdev from every macro, the delay of each
+ * dropped event goes to the next one kept.
+ */
+static void ms_sidewinder_macro_purge(struct ms_sidewinder_group *group,
+		struct hid_device *hdev)
+{
+	struct ms_sidewinder_macro *macro;
+	unsigned int p, i, j, n;
+	u32 delay;
+
+	for (p = 0; p < MS_SIDEWINDER_PROFILES; p++) {
+		for (i = 0; i < MS_SIDEWINDER_MACRO_KEYS; i++) {
+			macro = group->macros[p][i];
+			if (!macro)
+				continue;
+
+			for (j = n = delay = 0; j < macro->count; j++) {
+				delay += macro->events[j].delay;
+				if (macro->events[j].hdev == hdev)
+					continue;
+				macro->events[n] = macro->events[j];
+				macro->events[n++].delay = delay;
+				delay = 0;
+			}
+			macro->count = n;
+			if (!n) {
+				kfree(macro);
+				group->macros[p][i] = NULL;
+			}
+		}
+	}
+}
+
+/*
+ * First half of unbinding @hdev, while its input devices are still
+ * registered: stop recording and replaying, and forget its events.
+ */
+static void ms_sidewinder_group_leave(struct ms_sidewinder_group *group,
+		struct hid_device *hdev)
+{
+	unsigned long flags;
+
+	if (!group)
+		return;
+
+	spin_lock_irqsave(&group->lock, flags);
+	group->leaving++;
+	group->rec_state = MS_SIDEWINDER_REC_IDLE;
+	group->play = NULL;
+	ms_sidewinder_macro_purge(group, hdev);
+	spin_unlock_irqrestore(&group->lock, flags);
+	hrtimer_cancel(&group->play_timer);
+}
+
+/*
+ * Second half, once @hdev sends no more events: purge what it typed in the
+ * meantime and let the other interfaces record and replay again.
+ */
+static void ms_sidewinder_group_put(struct ms_sidewinder_group *group,
+		struct hid_device *hdev)
+{
+	unsigned long flags;
+	int p, i;
+
+	if (!group)
+		return;
+
+	spin_lock_irqsave(&group->lock, flags);
+	ms_sidewinder_macro_purge(group, hdev);
+	group->leaving--;
+	spin_unlock_irqrestore(&group->lock, flags);
+
+	mutex_lock(&ms_sidewinder_groups_lock);
+	if (!--group->users) {
+		for (p = 0; p < MS_SIDEWINDER_PROFILES; p++)
+			for (i = 0; i < MS_SIDEWINDER_MACRO_KEYS; i++)
+				kfree(group->macros[p][i]);
+		list_del(&group->node);
+		kfree(group);
+	}
+	mutex_unlock(&ms_sidewinder_groups_lock);
+}
+
+/* Record a key typed on any interface of the keyboard */
+static void ms_sidewinder_macro_capture(struct ms_sidewinder_group *group,
+		struct input_dev *input, unsigned int code, __s32 value)
+{
+	struct ms_sidewinder_macro_event *ev;
+	unsigned long flags;
+	ktime_t now;
+
+	if (READ_ONCE(group->rec_state) != MS_SIDEWINDER_REC_ON || code >= KEY_CNT)
+		return;
+
+	spin_lock_irqsave(&group->lock, flags);
+	if (group->rec_state != MS_SIDEWINDER_REC_ON ||
+			group->rec_count >= MS_SIDEWINDER_MACRO_EVENTS ||
+			!!value == test_bit(code, group->rec_keys))
+		goto out;
+
+	now = ktime_get();
+	ev = &group->rec[group->rec_count];
+	ev->hdev = input_get_drvdata(input);
+	ev->input = input;
+	ev->code = code;
+	ev->value = !!value;
+	ev->delay = group->rec_count ? ktime_us_delta(now, group->rec_last) : 0;
+	group->rec_last = now;
+	group->rec_count++;
+	value ? __set_bit(code, group->rec_keys) : __clear_bit(code, group->rec_keys);
+out:
+	spin_unlock_irqrestore(&group->lock, flags);
+}
+
+/* Store the recorded events as macro, releasing keys still held */
+static void ms_sidewinder_macro_store(struct ms_sidewinder_group *group)
+{
+	struct ms_sidewinder_macro *macro = NULL, *old;
+	unsigned int code, i, count = group->rec_count;
+
+	for_each_set_bit(code, group->rec_keys, KEY_CNT) {
+		if (count >= MS_SIDEWINDER_MACRO_EVENTS)
+			break;
+		/* Find the press, for the input device it came from */
+		for (i = count; i-- > 0; ) {
+			if (group->rec[i].code == code)
+				break;
+		}
+		group->rec[count] = group->rec[i];
+		group->rec[count].delay = 0;
+		group->rec[count].value = 0;
+		count++;
+	}
+
+	if (count) {
+		macro = kmalloc(struct_size(macro, events, count), GFP_ATOMIC);
+		if (macro) {
+			macro->count = count;
+			memcpy(macro->events, group->rec, count * sizeof(*group->rec));
+		}
+	}
+
+	old = group->macros[group->rec_profile - 1][group->rec_key];
+	if (group->play == old)
+		group->play = NULL;
+	group->macros[group->rec_profile - 1][group->rec_key] = macro;
+	kfree(old);
+}
+
+/* Macro Record key: arm, cancel or finish recording */
+static void ms_sidewinder_macro_record_key(struct hid_device *hdev,
+		struct ms_sidewinder_extra *sidewinder)
+{
+	struct ms_sidewinder_group *group = sidewinder->group;
+	__u8 leds = 0;
+	unsigned long flags;
+
+	if (!group || !macro_record)
+		return;
+
+	spin_lock_irqsave(&group->lock, flags);
+	if (group->leaving) {
+		spin_unlock_irqrestore(&group->lock, flags);
+		return;
+	}
+
+	switch (group->rec_state) {
+	case MS_SIDEWINDER_REC_IDLE:
+		group->rec_state = MS_SIDEWINDER_REC_ARMED;
+		leds = 0x40;	/* Record LED Blink */
+		break;
+	case MS_SIDEWINDER_REC_ARMED:
+		group->rec_state = MS_SIDEWINDER_REC_IDLE;
+		break;
+	case MS_SIDEWINDER_REC_ON:
+		ms_sidewinder_macro_store(group);
+		group->rec_state = MS_SIDEWINDER_REC_IDLE;
+		break;
+	}
+	spin_unlock_irqrestore(&group->lock, flags);
+
+	ms_sidewinder_control(hdev, 0x60, leds);	/* Clear Record LED */
+}
+
+/* S1 - S30 key press: pick the slot to record to, or replay its macro */
+static void ms_sidewinder_macro_key(struct hid_device *hdev,
+		struct ms_sidewinder_extra *sidewinder, unsigned int key)
+{
+	struct ms_sidewinder_group *group = sidewinder->group;
+	unsigned int profile = ms_sidewinder_profile(sidewinder);
+	bool recording = false;
+	unsigned long flags;
+
+	if (!group || !macro_record || profile < 1 ||
+			profile > MS_SIDEWINDER_PROFILES)
+		return;
+
+	spin_lock_irqsave(&group->lock, flags);
+	if (group->leaving) {
+		/* Nothing to do */
+	} else if (group->rec_state == MS_SIDEWINDER_REC_ARMED) {
+		group->rec_state = MS_SIDEWINDER_REC_ON;
+		group->rec_profile = profile;
+		group->rec_key = key;
+		group->rec_count = 0;
+		bitmap_zero(group->rec_keys, KEY_CNT);
+		recording = true;
+	} else if (group->rec_state == MS_SIDEWINDER_REC_IDLE && !group->play &&
+			group->macros[profile - 1][key]) {
+		group->play = group->macros[profile - 1][key];
+		group->play_pos = 0;
+		hrtimer_start(&group->play_timer, 0, HRTIMER_MODE_REL_SOFT);
+	}
+	spin_unlock_irqrestore(&group->lock, flags);
+
+	if (recording)	/* Record LED Solid */
+		ms_sidewinder_control(hdev, 0x60, 0x20);
+}
+
+/* Every S1 - S30 key transition ends up here */
+static void ms_sidewinder_macro_event(struct hid_device *hdev,
+		struct ms_sidewinder_extra *sidewinder, unsigned int key, int value)
+{
+	ms_sidewinder_ring_push(sidewinder, key, value);
+	if (value)
+		ms_sidewinder_macro_key(hdev, sidewinder, key);
+}
+
+/*
+ * Key bitmap fast path
+ *
+ * Compares the bitmap with the previous one a word at a time and only sends
+ * the keys that changed, followed by a single input_sync(). hid-core still
+ * extracts every bit and calls ms_event() for each usage, which only claims
+ * them; what goes away is hid-input's handling of each key.
+ */
+static void ms_sidewinder_nkro_event(struct hid_device *hdev,
+		struct ms_sidewinder_extra *sidewinder, u8 *data, int size)
+{
+	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_sidewinder_nkro *nkro = READ_ONCE(sidewinder->nkro);
+	DECLARE_BITMAP(cur, MS_SIDEWINDER_NKRO_BITS);
+	unsigned long changed;
+	unsigned int bytes = DIV_ROUND_UP(nkro->bits, 8);
+	unsigned int i, bit;
+	bool sync = false;
+
+	/* Bytes missing from short reports read as zero, as in hid-core */
+	bitmap_zero(cur, MS_SIDEWINDER_NKRO_BITS);
+	for (i = 0; i < bytes && nkro->start + i < size; i++)
+		cur[i / sizeof(long)] |= (unsigned long)data[nkro->start + i] <<
+				(8 * (i % sizeof(long)));
+
+	for (i = 0; i < BITS_TO_LONGS(nkro->bits); i++) {
+		changed = (cur[i] ^ nkro->last[i]) & nkro->keys[i];
+		if (!changed)
+			continue;
+
+		for_each_set_bit(bit, &changed, BITS_PER_LONG) {
+			struct hid_usage *usage = nkro->usage[i * BITS_PER_LONG + bit];
+			unsigned int code = READ_ONCE(usage->code);
+			int value = test_bit(bit, &cur[i]);
+
+			ms_stat_inc(sc, MS_STAT_NKRO_KEYS);
+			if (!code)
+				continue;
+			if (sidewinder->group)
+				ms_sidewinder_macro_capture(sidewinder->group,
+						nkro->input, code, value);
+			ms_input_event(hdev, nkro->input, EV_KEY, code, value);
+			sync = true;
+		}
+		nkro->last[i] = cur[i];
+	}
+
+	if (sync)
+		input_sync(nkro->input);
+}
+
+/*
+ * Sidewinder S1 - S30 fast path
+ *
+ * Builds the new key_mask from the raw report in one pass, instead of
+ * having hid-core call ms_event() for every single macro key usage.
+ */
+static int ms_raw_event(struct hid_device *hdev, struct hid_report *report,
+		u8 *data, int size)
+{
+	struct ms_data *sc;
+	struct ms_sidewinder_extra *sidewinder;
+	struct ms_sidewinder_nkro *nkro;
+	unsigned long mask = 0, changed;
+	unsigned int i;
+	bool is_nkro;
+
+	if (!static_branch_unlikely(&ms_report_key))
+		return 0;
+
+	sc = hid_get_drvdata(hdev);
+	if (!(sc->quirks & MS_REPORT_QUIRKS))
+		return 0;
+
+	trace_ms_report(hdev, report, size);
+	ms_stat_inc(sc, MS_STAT_REPORTS);
+	if (sc->quirks & (MS_ERGONOMY | MS_SIDEWINDER))
+		sc->report_time = ktime_get();
+
+	if (!static_branch_unlikely(&ms_sidewinder_key) ||
+			!(sc->quirks & MS_SIDEWINDER) || report->type != HID_INPUT_REPORT)
+		return 0;
+
+	sidewinder = sc->extra;
+	nkro = READ_ONCE(sidewinder->nkro);
+	is_nkro = nkro && report == nkro->report;
+	if (!is_nkro &&
+			(!sidewinder->macro_keys || report->id != sidewinder->macro_report))
+		return 0;
+
+	/* Skip the report id, report_offset does not account for it */
+	if (hdev->report_enum[HID_INPUT_REPORT].numbered) {
+		data++;
+		size--;
+	}
+
+	if (is_nkro) {
+		ms_sidewinder_nkro_event(hdev, sidewinder, data, size);
+		return 0;
+	}
+
+	for_each_set_bit(i, &sidewinder->macro_keys, MS_SIDEWINDER_MACRO_KEYS) {
+		unsigned int offset = sidewinder->macro_offset[i];
+
+		if ((offset >> 3) < size && (data[offset >> 3] & BIT(offset & 7)))
+			mask |= BIT(i);
+	}
+
+	/* key_mask is the low end of the state, only written if it changed */
+	changed = (ms_sidewinder_update(sidewinder, sidewinder->macro_keys,
+			mask, 0) ^ mask) & sidewinder->macro_keys;
+	if (!changed)
+		return 0;
+
+	set_bit(MS_SIDEWINDER_NOTIFY_KEY_MASK, &sidewinder->notify);
+
+	for_each_set_bit(i, &changed, MS_SIDEWINDER_MACRO_KEYS) {
+		trace_ms_key(hdev, HID_UP_MSVENDOR | (sc->usages->range_first + i),
+				test_bit(i, &mask));
+		ms_stat_inc(sc, MS_STAT_MACRO_KEYS);
+		ms_sidewinder_macro_event(hdev, sidewinder, i, test_bit(i, &mask));
+	}
+
+	if (sidewinder->input) {
+		for_each_set_bit(i, &changed, MS_SIDEWINDER_MACRO_KEYS)
+			ms_sidewinder_emit_key(sidewinder, i, test_bit(i, &mask));
+		input_sync(sidewinder->input);
 	}
 
 	return 0;
 }
 
-/*
- * Sidewinder sysfs
- * @key_mask: show pressed special keys
- * @profile: show and set profile count and LED status
- * @auto_led: show and set LED Auto
- * @record_led: show and set Record LED
- */
-static ssize_t ms_sidewinder_key_mask_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+/* Presenter keys are left to hid-input, only count them */
+static int ms_presenter_event(struct hid_device *hdev, struct hid_field *field,
+		struct hid_usage *usage, __s32 value)
 {
-	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
 	struct ms_data *sc = hid_get_drvdata(hdev);
-	struct ms_sidewinder_extra *sidewinder = sc->extra;
 
-	return snprintf(buf, PAGE_SIZE, "%lu\n", sidewinder->key_mask);
-}
+	if ((usage->hid & HID_USAGE_PAGE) == HID_UP_MSVENDOR && usage->type)
+		ms_stat_inc(sc, MS_STAT_USAGES_PRESENTER);
 
-static struct device_attribute dev_attr_ms_sidewinder_key_mask = {
-	.attr = { .name = __stringify(key_mask), .mode = S_IRUGO },
-	.show = ms_sidewinder_key_mask_show
-};
+	return 0;
+}
 
-static ssize_t ms_sidewinder_profile_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+/* Handling MS keyboards special buttons */
+static int ms_ergonomy_event(struct hid_device *hdev, struct hid_field *field,
+		struct hid_usage *usage, __s32 value)
 {
-	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
 	struct ms_data *sc = hid_get_drvdata(hdev);
-	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	struct ms_ergonomy_extra *ergonomy = sc->extra;
+	unsigned long changed;
+	unsigned int code, bit;
+
+	if (!field->hidinput || !usage->type ||
+			ms_usage_lookup(sc->usages, usage->hid, &code, &bit) !=
+			MS_USAGE_FAVORITES)
+		return 0;
+
+	trace_ms_key(hdev, usage->hid, value);
+	ms_stat_inc(sc, MS_STAT_USAGES_ERGONOMY);
+	/* One bit per key, 0x01 - 0x10 are F14 - F18 */
+	changed = (value ^ ergonomy->last_mask) & 0x1f;
+	for_each_set_bit(bit, &changed, MS_ERGONOMY_FAVORITES)
+		ms_input_event(hdev, field->hidinput->input, usage->type,
+				READ_ONCE(ergonomy->key_code[bit]),
+				!!(value & BIT(bit)));
+	ergonomy->last_mask = value & 0x1f;
 
-	return snprintf(buf, PAGE_SIZE, "%1u\n", sidewinder->profile);
+	return 1;
 }
 
-static ssize_t ms_sidewinder_profile_store(struct device *dev,
-		struct device_attribute *attr, char const *buf, size_t count)
+/*
+ * Sidewinder special button handling & profile switching
+ *
+ * Pressing S1 - S30 macro keys will set bits on key_mask (readable
+ * via sysfs), and only send out keycodes if emit_keys is set. It's
+ * possible to press multiple special keys at the same time.
+ *
+ * Only the vendor usages of the table are claimed, everything else goes
+ * on to hid-input.
+ */
+static int ms_sidewinder_event(struct hid_device *hdev, struct hid_field *field,
+		struct hid_usage *usage, __s32 value)
 {
-	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
 	struct ms_data *sc = hid_get_drvdata(hdev);
 	struct ms_sidewinder_extra *sidewinder = sc->extra;
-	__u8 leds = sidewinder->status & ~(0x1c);	/* Clear Profile LEDs */
+	struct ms_sidewinder_nkro *nkro;
+	struct input_dev *input;
+	unsigned int kind, code, i;
 
-	if (sscanf(buf, "%1u", &sidewinder->profile) != 1)
-		return -EINVAL;
+	if (!field->hidinput || !usage->type)
+		return 0;
 
-	if (sidewinder->profile >= 1 && sidewinder->profile <= 3) {
-		leds |= 0x02 << sidewinder->profile;
-		ms_sidewinder_control(hdev, leds);
-		return strnlen(buf, PAGE_SIZE);
-	} else
-		return -EINVAL;
-}
+	/* Key bitmap, already sent by ms_raw_event() */
+	nkro = READ_ONCE(sidewinder->nkro);
+	if (nkro && field->report == nkro->report && ms_sidewinder_nkro_field(field))
+		return 1;
 
-static struct device_attribute dev_attr_ms_sidewinder_profile =
-	__ATTR(profile, S_IWUSR | S_IRUGO,
-		ms_sidewinder_profile_show,
-		ms_sidewinder_profile_store);
+	input = field->hidinput->input;
 
-static ssize_t ms_sidewinder_record_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
-{
-	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
-	struct ms_data *sc = hid_get_drvdata(hdev);
-	struct ms_sidewinder_extra *sidewinder = sc->extra;
+	/* Regular keys of the keyboard, only looked at for recording */
+	if ((usage->hid & HID_USAGE_PAGE) != HID_UP_MSVENDOR &&
+			usage->type == EV_KEY && sidewinder->group)
+		ms_sidewinder_macro_capture(sidewinder->group, input,
+				usage->code, value);
+
+	kind = ms_usage_lookup(sc->usages, usage->hid, &code, &i);
+	if (kind == MS_USAGE_NONE)
+		return 0;
+
+	trace_ms_key(hdev, usage->hid, value);
+	ms_stat_inc(sc, MS_STAT_USAGES_SIDEWINDER);
+
+	switch (kind) {
+	case MS_USAGE_MACRO:
+		/* Unless ms_raw_event() already decoded it */
+		if (!test_bit(i, &sidewinder->macro_keys) &&
+				!!value != !!(ms_sidewinder_update(sidewinder, BIT_ULL(i),
+				value ? BIT_ULL(i) : 0, 0) & BIT_ULL(i))) {
+			set_bit(MS_SIDEWINDER_NOTIFY_KEY_MASK, &sidewinder->notify);
+			ms_stat_inc(sc, MS_STAT_MACRO_KEYS);
+			ms_sidewinder_macro_event(hdev, sidewinder, i, value);
+			ms_sidewinder_emit_key(sidewinder, i, value);
+		}
+		break;
+	case MS_USAGE_MACRO_PAD:
+		if (sidewinder->emit_keys)
+			ms_input_event(hdev, input, usage->type, usage->code, value);
+		if (value)	/* Run this only once on a keypress */
+			ms_sidewinder_toggle(hdev, 0x01);	/* Toggle Macro Pad */
+		break;
+	case MS_USAGE_RECORD:
+		ms_input_event(hdev, input, usage->type, usage->code, value);
+		if (value)
+			ms_sidewinder_macro_record_key(hdev, sidewinder);
+		break;
+	case MS_USAGE_PROFILE:
+		if (sidewinder->emit_keys)
+			ms_input_event(hdev, input, usage->type, usage->code, value);
+		if (value) {	/* Run this only once on a keypress */
+			unsigned int profile = ms_sidewinder_profile(sidewinder);
+
+			if (profile < 1 || profile >= 3)
+				profile = 1;
+			else
+				profile++;
+
+			ms_sidewinder_set_profile(hdev, profile);
+		}
+		break;
+	}
 
-	return snprintf(buf, PAGE_SIZE, "%1d\n", (sidewinder->status & 0x60) >> 5);
+	return 1;
 }
 
-static ssize_t ms_sidewinder_record_store(struct device *dev,
-		struct device_attribute *attr, char const *buf, size_t count)
+/*
+ * Per usage callback, forwarded to the decoder ms_event_handler() picked
+ * for this interface. Nothing to do at all as long as no bound interface
+ * has one.
+ */
+static int ms_event(struct hid_device *hdev, struct hid_field *field,
+		struct hid_usage *usage, __s32 value)
 {
-	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
-	struct ms_data *sc = hid_get_drvdata(hdev);
-	struct ms_sidewinder_extra *sidewinder = sc->extra;
-	unsigned int record_led;
-	__u8 leds;
+	struct ms_data *sc;
+	ms_event_t event;
 
-	if (sscanf(buf, "%1d", &record_led) != 1)
-		return -EINVAL;
+	if (!static_branch_unlikely(&ms_event_key))
+		return 0;
 
-	if (record_led >= 0 && record_led <= 2) {
-		leds = sidewinder->status & ~(0xe0);	/* Clear Record LED */
-		if (record_led)
-			leds |= 0x10 << record_led;
-		ms_sidewinder_control(hdev, leds);
-		return strnlen(buf, PAGE_SIZE);
-	} else
-		return -EINVAL;
+	sc = hid_get_drvdata(hdev);
+	event = READ_ONCE(sc->event);
+	return event ? event(hdev, field, usage, value) : 0;
 }
 
-static struct device_attribute dev_attr_ms_sidewinder_record =
-	__ATTR(record_led, S_IWUSR | S_IRUGO,
-		ms_sidewinder_record_show,
-		ms_sidewinder_record_store);
-
-static ssize_t ms_sidewinder_auto_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+/* Decoder needed by an interface, once hid-input is done mapping it */
+static ms_event_t ms_event_handler(struct hid_device *hdev)
 {
-	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
 	struct ms_data *sc = hid_get_drvdata(hdev);
-	struct ms_sidewinder_extra *sidewinder = sc->extra;
 
-	return snprintf(buf, PAGE_SIZE, "%1d\n", (sidewinder->status & 0x02) >> 1);	/* Check if Auto LED bit is set */
+	if (sc->quirks & MS_ERGONOMY) {
+		struct ms_ergonomy_extra *ergonomy = sc->extra;
+
+		return ergonomy->input ? ms_ergonomy_event : NULL;
+	}
+	if (sc->quirks & MS_PRESENTER)
+		return ms_presenter_event;
+	if (sc->quirks & MS_SIDEWINDER)
+		return ms_sidewinder_event;
+
+	return NULL;
 }
 
-static ssize_t ms_sidewinder_auto_store(struct device *dev,
-		struct device_attribute *attr, char const *buf, size_t count)
+static int ms_input_configured(struct hid_device *hdev, struct hid_input *hi)
 {
-	struct hid_device *hdev = container_of(dev, struct hid_device, dev);
 	struct ms_data *sc = hid_get_drvdata(hdev);
-	struct ms_sidewinder_extra *sidewinder = sc->extra;
-	unsigned int auto_led;
-	__u8 leds;
-
-	if (sscanf(buf, "%1d", &auto_led) != 1)
-		return -EINVAL;
 
-	if (auto_led == 0 || auto_led == 1) {
-		leds = sidewinder->status & ~(0x02);	/* Clear Auto LED */
-		if (auto_led)
-			leds |= 0x02;
-		ms_sidewinder_control(hdev, leds);
-		return strnlen(buf, PAGE_SIZE);
-	} else
-		return -EINVAL;
-}
-
-static struct device_attribute dev_attr_ms_sidewinder_auto =
-	__ATTR(auto_led, S_IWUSR | S_IRUGO,
-		ms_sidewinder_auto_show,
-		ms_sidewinder_auto_store);
+	/*
+	 * Input devices are registered, and may be opened, right after their
+	 * input_configured(). Have the decoder in place before the first one
+	 * is, like the key bitmap decoding below.
+	 */
+	if (!sc->event) {
+		ms_event_t event = ms_event_handler(hdev);
 
-static struct attribute *ms_attributes[] = {
-	&dev_attr_ms_sidewinder_key_mask.attr,
-	&dev_attr_ms_sidewinder_profile.attr,
-	&dev_attr_ms_sidewinder_record.attr,
-	&dev_attr_ms_sidewinder_auto.attr,
-	NULL
-};
+		if (event) {
+			static_branch_inc(&ms_event_key);
+			smp_store_release(&sc->event, event);
+		}
+	}
 
-static const struct attribute_group ms_attr_group = {
-	.attrs = ms_attributes,
-};
+	if (sc->quirks & MS_SIDEWINDER) {
+		struct ms_sidewinder_extra *sidewinder = sc->extra;
 
-static int ms_input_mapping(struct hid_device *hdev, struct hid_input *hi,
-		struct hid_field *field, struct hid_usage *usage,
-		unsigned long **bit, int *max)
-{
-	struct ms_data *sc = hid_get_drvdata(hdev);
+		if (nkro && !sidewinder->nkro && ms_sidewinder_nkro_init(hdev, hi))
+			hid_warn(hdev, "Could not set up key bitmap decoding\n");
 
-	if ((usage->hid & HID_USAGE_PAGE) != HID_UP_MSVENDOR)
-		return 0;
+		if (sidewinder->macro_bitmap && hi->input == sidewinder->input) {
+			sidewinder->getkeycode = hi->input->getkeycode;
+			sidewinder->setkeycode = hi->input->setkeycode;
+			hi->input->getkeycode = ms_sidewinder_getkeycode;
+			hi->input->setkeycode = ms_sidewinder_setkeycode;
+		}
+	}
 
 	if (sc->quirks & MS_ERGONOMY) {
-		int ret = ms_ergonomy_kb_quirk(hi, usage, bit, max);
-		if (ret)
-			return ret;
-	}
+		struct ms_ergonomy_extra *ergonomy = sc->extra;
+		struct input_dev *input = hi->input;
 
-	if ((sc->quirks & MS_PRESENTER) &&
-			ms_presenter_8k_quirk(hi, usage, bit, max))
-		return 1;
+		if (input != ergonomy->input)
+			return 0;
 
-	if ((sc->quirks & MS_SIDEWINDER) &&
-			ms_sidewinder_kb_quirk(hi, usage, bit, max))
-		return 1;
+		ergonomy->getkeycode = input->getkeycode;
+		ergonomy->setkeycode = input->setkeycode;
+		input->getkeycode = ms_ergonomy_getkeycode;
+		input->setkeycode = ms_ergonomy_setkeycode;
+	}
 
 	return 0;
 }
 
-static int ms_input_mapped(struct hid_device *hdev, struct hid_input *hi,
-		struct hid_field *field, struct hid_usage *usage,
-		unsigned long **bit, int *max)
+/* Called once hid-core is done with all fields of a report */
+static void ms_report(struct hid_device *hdev, struct hid_report *report)
 {
-	struct ms_data *sc = hid_get_drvdata(hdev);
+	struct ms_data *sc;
 
-	if (sc->quirks & MS_DUPLICATE_USAGES)
-		clear_bit(usage->code, *bit);
+	if (!static_branch_unlikely(&ms_sidewinder_key))
+		return;
 
-	return 0;
+	sc = hid_get_drvdata(hdev);
+	if (sc->quirks & MS_SIDEWINDER)
+		ms_sidewinder_notify(sc->extra);
 }
 
-/* Setting initial profile and LED of Sidewinder keyboards */
-static void ms_feature_mapping(struct hid_device *hdev,
-		struct hid_field *field, struct hid_usage *usage)
+static void ms_latency_show_one(struct seq_file *m, const char *name,
+		struct ms_latency *lat)
 {
-	struct ms_data *sc = hid_get_drvdata(hdev);
-
-	if (sc->quirks & MS_SIDEWINDER) {
-		struct ms_sidewinder_extra *sidewinder = sc->extra;
-
-		sidewinder->profile = 1;
-		ms_sidewinder_control(hdev, 0x02 << sidewinder->profile);
-	}
+	int i;
+
+	seq_printf(m, "%s latency (us):\n", name);
+	for (i = 0; i < MS_LATENCY_BUCKETS - 1; i++)
+		seq_printf(m, "  < %7lu: %lu\n", 1UL << i,
+				atomic_long_read(&lat->bucket[i]));
+	seq_printf(m, "  >=%7lu: %lu\n", 1UL << i,
+			atomic_long_read(&lat->bucket[i]));
 }
 
-static int ms_event(struct hid_device *hdev, struct hid_field *field,
-		struct hid_usage *usage, __s32 value)
+static int ms_latency_show(struct seq_file *m, void *unused)
 {
-	struct ms_data *sc = hid_get_drvdata(hdev);
-
-	if (!(hdev->claimed & HID_CLAIMED_INPUT) || !field->hidinput ||
-			!usage->type)
-		return 0;
+	struct ms_data *sc = m->private;
 
-	/* Handling MS keyboards special buttons */
-	if (sc->quirks & MS_ERGONOMY && usage->hid == (HID_UP_MSVENDOR | 0xff05)) {
-		struct input_dev *input = field->hidinput->input;
-		static unsigned int last_key = 0;
-		unsigned int key = 0;
-		switch (value) {
-		case 0x01: key = KEY_F14; break;
-		case 0x02: key = KEY_F15; break;
-		case 0x04: key = KEY_F16; break;
-		case 0x08: key = KEY_F17; break;
-		case 0x10: key = KEY_F18; break;
-		}
-		if (key) {
-			input_event(input, usage->type, key, 1);
-			last_key = key;
-		} else
-			input_event(input, usage->type, last_key, 0);
-
-		return 1;
-	}
+	ms_latency_show_one(m, "input", &sc->input_latency);
+	if (sc->quirks & MS_SIDEWINDER)
+		ms_latency_show_one(m, "led", &sc->led_latency);
 
-	/*
-	 * Sidewinder special button handling & profile switching
-	 *
-	 * Pressing S1 - S30 macro keys will not send out any keycodes, but
-	 * set bits on key_mask (readable via sysfs). It's possible to press
-	 * multiple special keys at the same time.
-	 */
-	if (sc->quirks & MS_SIDEWINDER) {
-		struct input_dev *input = field->hidinput->input;
-		struct ms_sidewinder_extra *sidewinder = sc->extra;
-		int i;
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ms_latency);
 
-		for (i = 0; i <= 29; i++) {	/* Run through S1 - S30 keys */
-			if ((usage->hid & HID_USAGE) == (0xfb01 + i)) {
-				value ? set_bit(i, &sidewinder->key_mask) : clear_bit(i, &sidewinder->key_mask);
-				break;	/* Exit loop, when correct hid usage has been found */
-			}
-		}
+static int ms_stats_show(struct seq_file *m, void *unused)
+{
+	struct ms_data *sc = m->private;
+	int cpu, i;
 
-		switch (usage->hid & HID_USAGE) {
-		case 0xfd11:
-			if (value) {	/* Run this only once on a keypress */
-				__u8 numpad = sidewinder->status ^ (0x01);	/* Toggle Macro Pad */
-				ms_sidewinder_control(hdev, numpad);
-			}
-			break;
-		case 0xfd12: input_event(input, usage->type, KEY_MACRO, value);	break;
-		case 0xfd15:
-			if (value) {	/* Run this only once on a keypress */
-				__u8 leds = sidewinder->status & ~(0x1c);	/* Clear Profile LEDs */
-				if (sidewinder->profile < 1 || sidewinder->profile >= 3) {	
-					sidewinder->profile = 1;
-				} else
-					sidewinder->profile++;
-
-				leds |= 0x02 << sidewinder->profile;	/* Set Profile LEDs */
-				ms_sidewinder_control(hdev, leds);
-			}
-			break;
-		}
+	for (i = 0; i < MS_STAT_MAX; i++) {
+		u64 sum = 0;
 
-		return 1;
+		for_each_possible_cpu(cpu)
+			sum += per_cpu_ptr(sc->stats, cpu)->count[i];
+		seq_printf(m, "%s: %llu\n", ms_stat_names[i], sum);
 	}
 
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(ms_stats);
+
+/* Only once nothing can look at the keymaps anymore */
+static void ms_sidewinder_free_keymaps(struct ms_sidewinder_extra *sidewinder)
+{
+	int i;
+
+	for (i = 0; i < MS_SIDEWINDER_PROFILES; i++)
+		kfree(rcu_dereference_protected(sidewinder->keymap[i], 1));
+}
 
 static int ms_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
 	struct ms_data *sc;
+	bool attr_group = false;
 	int ret;
 
 	sc = devm_kzalloc(&hdev->dev, sizeof(struct ms_data), GFP_KERNEL);
@@ -490,14 +2794,37 @@ static int ms_probe(struct hid_device *hdev, const struct hid_device_id *id)
 		return -ENOMEM;
 	}
 
+	sc->stats = devm_alloc_percpu(&hdev->dev, struct ms_stats);
+	if (!sc->stats) {
+		hid_err(hdev, "can't alloc microsoft statistics\n");
+		return -ENOMEM;
+	}
+
 	sc->quirks = id->driver_data;
+	sc->usages = ms_usage_table(sc->quirks);
 	hid_set_drvdata(hdev, sc);
 
 	if (sc->quirks & MS_NOGET)
 		hdev->quirks |= HID_QUIRK_NOGET;
 
+	/* kzalloc() rather than devm, for the cacheline alignment */
+	if (sc->quirks & MS_ERGONOMY) {
+		struct ms_ergonomy_extra *ergonomy;
+		int i;
+
+		ergonomy = kzalloc(sizeof(struct ms_ergonomy_extra), GFP_KERNEL);
+		if (!ergonomy) {
+			hid_err(hdev, "can't alloc microsoft descriptor\n");
+			return -ENOMEM;
+		}
+		for (i = 0; i < MS_ERGONOMY_FAVORITES; i++)
+			ergonomy->key_code[i] = KEY_F14 + i;
+		sc->extra = ergonomy;
+	}
+
 	if (sc->quirks & MS_SIDEWINDER) {
 		struct ms_sidewinder_extra *sidewinder;
+		int i;
 
 		sidewinder = devm_kzalloc(&hdev->dev, sizeof(struct ms_sidewinder_extra),
 					GFP_KERNEL);
@@ -505,16 +2832,47 @@ static int ms_probe(struct hid_device *hdev, const struct hid_device_id *id)
 			hid_err(hdev, "can't alloc microsoft descriptor\n");
 			return -ENOMEM;
 		}
+		sidewinder->emit_keys = macro_keys;
+		sidewinder->hdev = hdev;
+		sidewinder->led_rate = led_rate;
+		for (i = 0; i < MS_SIDEWINDER_MACRO_KEYS; i++)
+			sidewinder->macro_code[i] = KEY_MACRO1 + i;
+		INIT_DELAYED_WORK(&sidewinder->led_work, ms_sidewinder_led_work);
+		spin_lock_init(&sidewinder->led_lock);
+		spin_lock_init(&sidewinder->key_lock);
+		mutex_init(&sidewinder->keymap_lock);
+		for (i = 0; i < MS_SIDEWINDER_PROFILES; i++) {
+			struct ms_sidewinder_keymap *keymap;
+
+			keymap = kzalloc(sizeof(struct ms_sidewinder_keymap), GFP_KERNEL);
+			if (!keymap) {
+				ms_sidewinder_free_keymaps(sidewinder);
+				return -ENOMEM;
+			}
+			RCU_INIT_POINTER(sidewinder->keymap[i], keymap);
+		}
+		sidewinder->group = ms_sidewinder_group_get(hdev);
+		if (!sidewinder->group)
+			hid_warn(hdev, "Could not set up macro recording\n");
 		sc->extra = sidewinder;
+		static_branch_inc(&ms_sidewinder_key);
 
 		/* Create sysfs files for the Consumer Control Device only */
 		if (hdev->type == 2) {
 			if (sysfs_create_group(&hdev->dev.kobj, &ms_attr_group)) {
 				hid_warn(hdev, "Could not create sysfs group\n");
+			} else {
+				attr_group = true;
+				for (i = 0; i < MS_SIDEWINDER_NOTIFY_MAX; i++)
+					sidewinder->kn[i] = sysfs_get_dirent(hdev->dev.kobj.sd,
+							ms_sidewinder_notify_names[i]);
 			}
 		}
 	}
 
+	if (sc->quirks & MS_REPORT_QUIRKS)
+		static_branch_inc(&ms_report_key);
+
 	ret = hid_parse(hdev);
 	if (ret) {
 		hid_err(hdev, "parse failed\n");
@@ -528,17 +2886,103 @@ static int ms_probe(struct hid_device *hdev, const struct hid_device_id *id)
 		goto err_free;
 	}
 
+	/* hid-input gave up on the interface after picking its decoder */
+	if (sc->event && !(hdev->claimed & HID_CLAIMED_INPUT)) {
+		WRITE_ONCE(sc->event, NULL);
+		static_branch_dec(&ms_event_key);
+	}
+
+	sc->debugfs = debugfs_create_dir(dev_name(&hdev->dev), ms_debugfs_root);
+	debugfs_create_file("latency", S_IRUSR, sc->debugfs, sc,
+			&ms_latency_fops);
+	debugfs_create_file("stats", S_IRUSR, sc->debugfs, sc, &ms_stats_fops);
+
+	/* Event ring for the interface carrying the S1 - S30 keys */
+	if (sc->quirks & MS_SIDEWINDER) {
+		struct ms_sidewinder_extra *sidewinder = sc->extra;
+
+		if (sidewinder->input && ms_sidewinder_ring_create(hdev))
+			hid_warn(hdev, "Could not create event ring device\n");
+	}
+
 	return 0;
 err_free:
+	if (sc->quirks & MS_SIDEWINDER) {
+		struct ms_sidewinder_extra *sidewinder = sc->extra;
+		unsigned long flags;
+		int i;
+
+		/* ms_feature_mapping() may already have queued a LED update */
+		spin_lock_irqsave(&sidewinder->led_lock, flags);
+		sidewinder->led_dead = true;
+		spin_unlock_irqrestore(&sidewinder->led_lock, flags);
+		cancel_delayed_work_sync(&sidewinder->led_work);
+
+		for (i = 0; i < MS_SIDEWINDER_NOTIFY_MAX; i++)
+			sysfs_put(sidewinder->kn[i]);
+		if (attr_group)
+			sysfs_remove_group(&hdev->dev.kobj, &ms_attr_group);
+
+		ms_sidewinder_group_leave(sidewinder->group, hdev);
+		ms_sidewinder_group_put(sidewinder->group, hdev);
+		kfree(sidewinder->nkro);
+		ms_sidewinder_free_keymaps(sidewinder);
+		static_branch_dec(&ms_sidewinder_key);
+	}
+	if (sc->event)
+		static_branch_dec(&ms_event_key);
+	if (sc->quirks & MS_REPORT_QUIRKS)
+		static_branch_dec(&ms_report_key);
+	if (sc->quirks & MS_ERGONOMY)
+		kfree(sc->extra);
 	return ret;
 }
 
 static void ms_remove(struct hid_device *hdev)
 {
+	struct ms_data *sc = hid_get_drvdata(hdev);
+
+	debugfs_remove_recursive(sc->debugfs);
+
 	sysfs_remove_group(&hdev->dev.kobj,
 		&ms_attr_group);
 
+	if (sc->quirks & MS_SIDEWINDER) {
+		struct ms_sidewinder_extra *sidewinder = sc->extra;
+		unsigned long flags;
+		int i;
+
+		for (i = 0; i < MS_SIDEWINDER_NOTIFY_MAX; i++)
+			sysfs_put(sidewinder->kn[i]);
+
+		/* No LED updates past this point */
+		spin_lock_irqsave(&sidewinder->led_lock, flags);
+		sidewinder->led_dead = true;
+		spin_unlock_irqrestore(&sidewinder->led_lock, flags);
+		cancel_delayed_work_sync(&sidewinder->led_work);
+
+		/* Stop replaying before the input devices go away */
+		ms_sidewinder_group_leave(sidewinder->group, hdev);
+	}
+
 	hid_hw_stop(hdev);
+
+	if (sc->event)
+		static_branch_dec(&ms_event_key);
+	if (sc->quirks & MS_REPORT_QUIRKS)
+		static_branch_dec(&ms_report_key);
+
+	if (sc->quirks & MS_SIDEWINDER) {
+		struct ms_sidewinder_extra *sidewinder = sc->extra;
+
+		ms_sidewinder_group_put(sidewinder->group, hdev);
+		kfree(sidewinder->nkro);
+		ms_sidewinder_ring_destroy(sidewinder);
+		ms_sidewinder_free_keymaps(sidewinder);
+		static_branch_dec(&ms_sidewinder_key);
+	}
+	if (sc->quirks & MS_ERGONOMY)
+		kfree(sc->extra);
 }
 
 static const struct hid_device_id ms_devices[] = {
@@ -553,11 +2997,11 @@ static const struct hid_device_id ms_devices[] = {
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_MS_NE4K_JP),
 		.driver_data = MS_ERGONOMY },
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_MS_LK6K),
-		.driver_data = MS_ERGONOMY | MS_RDESC },
+		.driver_data = MS_ERGONOMY },
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_MS_PRESENTER_8K_USB),
 		.driver_data = MS_PRESENTER },
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_MS_DIGITAL_MEDIA_3K),
-		.driver_data = MS_ERGONOMY | MS_RDESC_3K },
+		.driver_data = MS_ERGONOMY },
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_WIRELESS_OPTICAL_DESKTOP_3_0),
 		.driver_data = MS_NOGET },
 	{ HID_USB_DEVICE(USB_VENDOR_ID_MICROSOFT, USB_DEVICE_ID_MS_COMFORT_MOUSE_4500),
@@ -579,11 +3023,39 @@ static struct hid_driver ms_driver = {
 	.report_fixup = ms_report_fixup,
 	.input_mapping = ms_input_mapping,
 	.input_mapped = ms_input_mapped,
+	.input_configured = ms_input_configured,
 	.feature_mapping = ms_feature_mapping,
+	.raw_event = ms_raw_event,
 	.event = ms_event,
+	.report = ms_report,
 	.probe = ms_probe,
 	.remove = ms_remove,
 };
-module_hid_driver(ms_driver);
+
+static int __init ms_init(void)
+{
+	int ret;
+
+	ms_debugfs_root = debugfs_create_dir("hid-microsoft", NULL);
+
+	ret = hid_register_driver(&ms_driver);
+	if (ret)
+		debugfs_remove_recursive(ms_debugfs_root);
+
+	return ret;
+}
+
+static void __exit ms_exit(void)
+{
+	hid_unregister_driver(&ms_driver);
+	debugfs_remove_recursive(ms_debugfs_root);
+}
+
+module_init(ms_init);
+module_exit(ms_exit);
+
+#if IS_ENABLED(CONFIG_HID_MICROSOFT_KUNIT_TEST)
+#include "hid-microsoft-test.c"
+#endif
 
 MODULE_LICENSE("GPL");
@@ -0,0 +1,103 @@
+/*
+ *  User-space interface of the Microsoft Sidewinder X4 / X6 support
+ *  in hid-microsoft
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#ifndef HID_SIDEWINDER_H_FILE
+#define HID_SIDEWINDER_H_FILE
+
+#include <linux/types.h>
+
+/*
+ * Sidewinder event ring
+ *
+ * Every S1 - S30 key transition is appended to a per-device ring, which
+ * can be consumed through /dev/sidewinderN, either with read() (which
+ * returns whole struct ms_sidewinder_event records) or by mmap()ing the
+ * ring read-only and following @head.
+ *
+ * @time: CLOCK_MONOTONIC timestamp in nanoseconds
+ * @key: macro key index, 0 - 29 for S1 - S30
+ * @value: 1 when pressed, 0 when released
+ * @profile: active profile (1 - 3)
+ */
+struct ms_sidewinder_event {
+	__u64 time;
+	__u8 key;
+	__u8 value;
+	__u8 profile;
+	__u8 reserved[5];
+};
+
+/*
+ * Start of the mmap()ed ring. Event number n is stored in slot
+ * n % @size of the event array found @offset bytes into the mapping.
+ * @head: number of events ever written, updated after the event itself
+ * @size: number of event slots, a power of two
+ * @offset: offset of the event array from the start of the mapping
+ * @state_offset: offset of the struct ms_sidewinder_state_page, which can
+ * also be mapped on its own
+ */
+struct ms_sidewinder_ring_header {
+	__u32 head;
+	__u32 size;
+	__u32 offset;
+	__u32 state_offset;
+	__u32 reserved[12];
+};
+
+/*
+ * Snapshot of the keyboard state, read from and written to the binary
+ * "state" sysfs attribute in one go. A write applies all of the writable
+ * fields at once, with at most one LED update sent to the keyboard.
+ * @generation: incremented on every change of the other fields, wraps
+ * around at 2^22. Ignored when written, so a snapshot read back can be
+ * modified and written as is.
+ * @key_mask: pressed S1 - S30 keys, bit 0 for S1. Ignored when written,
+ * like @generation.
+ * @profile: active profile (1 - 3)
+ * @auto_led: Auto LED off (0) or on (1)
+ * @record_led: Record LED off (0), solid (1) or blinking (2)
+ * @macro_pad: X6 only, Macro Pad mode off (0) or on (1)
+ * @reserved: always 0, writes with anything else are rejected
+ */
+struct ms_sidewinder_state {
+	__u32 generation;
+	__u32 key_mask;
+	__u8 profile;
+	__u8 auto_led;
+	__u8 record_led;
+	__u8 macro_pad;
+	__u8 reserved[4];
+};
+
+/*
+ * Current state, updated in place by the driver, so it can be sampled
+ * with plain loads from the mmap()ed page:
+ *
+ *	do {
+ *		seq = READ_ONCE(page->seq);
+ *		smp_rmb();
+ *		state = page->state;
+ *		smp_rmb();
+ *	} while ((seq & 1) || seq != READ_ONCE(page->seq));
+ *
+ * @seq: odd while an update is in progress
+ * @time: CLOCK_MONOTONIC timestamp of the last change, in nanoseconds
+ * @state: as read from the "state" sysfs attribute
+ */
+struct ms_sidewinder_state_page {
+	__u32 seq;
+	__u32 reserved;
+	__u64 time;
+	struct ms_sidewinder_state state;
+};
+
+#endif
@@ -0,0 +1,1411 @@
+/*
+ *  sidewinder-uhid - emulate Microsoft Sidewinder X4 / X6 keyboards through
+ *  /dev/uhid, and benchmark hid-microsoft with them
+ *
+ *  Creates a virtual keyboard, answers the feature report 7 requests sent
+ *  by the driver for the LEDs, and replays input reports at a given rate.
+ *  It reports the achieved report rate and the latency from writing a
+ *  report to reading the resulting event from the evdev node, optionally
+ *  while all CPUs and the driver's LED work are kept busy.
+ *
+ *  Besides the X4 and X6 (MS_SIDEWINDER), a Natural Ergonomic Keyboard 4000
+ *  (MS_ERGONOMY) and a Presenter 8000 (MS_PRESENTER) can be emulated, so
+ *  every quirk class of the driver can be measured. With -c, dozens of
+ *  keyboards can be driven in parallel to see how the driver scales.
+ *
+ *  The x4-kbd model sends plain keys through an X4, to compare against
+ *  generic-kbd, the same keyboard under hid-generic. x4-nkro and
+ *  generic-nkro do the same with 24 key chords on an anti-ghosting key
+ *  bitmap: with hid-microsoft's nkro parameter set, x4-nkro measures its
+ *  bitmap diff, without it hid-input handling each key. x4-mixed sends
+ *  standard consumer keys through the interface carrying the S keys, which
+ *  hid-microsoft must leave to hid-input.
+ *
+ *  With -C, every report must produce its key events: the run fails, and
+ *  the exit status is 1, if any went missing. That makes the models
+ *  regression tests for keys the driver should not swallow.
+ *
+ *  The S1 - S30 keys only show up on evdev when hid-microsoft is loaded
+ *  with macro_keys=1. Needs root, for /dev/uhid and /dev/input.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#define SW_VENDOR		0x045e
+#define SW_PRODUCT_X6		0x074b
+#define SW_PRODUCT_X4		0x0768
+#define SW_PRODUCT_NE4K		0x00db
+#define SW_PRODUCT_PRESENTER	0x0713
+
+/* pid.codes test IDs, for a keyboard only hid-generic binds to */
+#define SW_VENDOR_GENERIC	0x1209
+#define SW_PRODUCT_GENERIC	0x0001
+
+#define SW_MACRO_REPORT		8
+#define SW_LED_REPORT		7
+
+/*
+ * Report descriptors of the vendor interface, carrying the S1 - S30 keys,
+ * the Macro Pad, Macro Record and Profile keys, and the LED feature report.
+ * They are built from what hid-microsoft expects (usages 0xfb01 - 0xfb1e,
+ * 0xfd11, 0xfd12 and 0xfd15, and feature report 7 with five LED bits and
+ * a two bit Record LED field), not dumped from real hardware. Use -d to
+ * replay a descriptor read from a real keyboard instead.
+ */
+#define SW_RDESC(keys, pad)						\
+	0x05, 0x0c,		/* Usage Page (Consumer) */		\
+	0x09, 0x01,		/* Usage (Consumer Control) */		\
+	0xa1, 0x01,		/* Collection (Application) */		\
+	0x85, SW_MACRO_REPORT,	/*   Report ID */			\
+	0x06, 0x00, 0xff,	/*   Usage Page (Vendor 0xff00) */	\
+	0x1a, 0x01, 0xfb,	/*   Usage Minimum (0xfb01) */		\
+	0x2a, 0x00 + (keys), 0xfb, /* Usage Maximum */			\
+	0x15, 0x00,		/*   Logical Minimum (0) */		\
+	0x25, 0x01,		/*   Logical Maximum (1) */		\
+	0x75, 0x01,		/*   Report Size (1) */			\
+	0x95, (keys),		/*   Report Count */			\
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */		\
+	0x95, (pad),		/*   Report Count */			\
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs) */		\
+	0x0a, 0x11, 0xfd,	/*   Usage (Macro Pad) */		\
+	0x0a, 0x12, 0xfd,	/*   Usage (Macro Record) */		\
+	0x0a, 0x15, 0xfd,	/*   Usage (Profile) */			\
+	0x95, 0x03,		/*   Report Count (3) */		\
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */		\
+	0x95, 0x05,		/*   Report Count (5) */		\
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs) */		\
+	0x85, SW_LED_REPORT,	/*   Report ID */			\
+	0x1a, 0x01, 0xfe,	/*   Usage Minimum (0xfe01) */		\
+	0x2a, 0x05, 0xfe,	/*   Usage Maximum (0xfe05) */		\
+	0x95, 0x05,		/*   Report Count (5) */		\
+	0xb1, 0x02,		/*   Feature (Data,Var,Abs) */		\
+	0x95, 0x03,		/*   Report Count (3) */		\
+	0xb1, 0x03,		/*   Feature (Cnst,Var,Abs) */		\
+	0x0a, 0x10, 0xfe,	/*   Usage (Record LED) */		\
+	0x25, 0x03,		/*   Logical Maximum (3) */		\
+	0x75, 0x02,		/*   Report Size (2) */			\
+	0x95, 0x01,		/*   Report Count (1) */		\
+	0xb1, 0x02,		/*   Feature (Data,Var,Abs) */		\
+	0x75, 0x06,		/*   Report Size (6) */			\
+	0xb1, 0x03,		/*   Feature (Cnst,Var,Abs) */		\
+	0xc0			/* End Collection */
+
+static const uint8_t sw_rdesc_x6[] = { SW_RDESC(30, 2) };
+static const uint8_t sw_rdesc_x4[] = { SW_RDESC(6, 2) };
+
+/*
+ * X4 vendor interface with standard consumer keys next to the S keys, in a
+ * report of their own
+ */
+static const uint8_t sw_rdesc_x4_mixed[] = {
+	SW_RDESC(6, 2),
+	0x05, 0x0c,		/* Usage Page (Consumer) */
+	0x09, 0x01,		/* Usage (Consumer Control) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x85, 0x01,		/*   Report ID (1) */
+	0x09, 0xe2,		/*   Usage (Mute) */
+	0x09, 0xe9,		/*   Usage (Volume Increment) */
+	0x09, 0xea,		/*   Usage (Volume Decrement) */
+	0x09, 0xcd,		/*   Usage (Play/Pause) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x25, 0x01,		/*   Logical Maximum (1) */
+	0x75, 0x01,		/*   Report Size (1) */
+	0x95, 0x04,		/*   Report Count (4) */
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs) */
+	0xc0			/* End Collection */
+};
+
+/* Favorites and zoom keys of the Natural Ergonomic Keyboard 4000 */
+static const uint8_t sw_rdesc_ne4k[] = {
+	0x05, 0x0c,		/* Usage Page (Consumer) */
+	0x09, 0x01,		/* Usage (Consumer Control) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x85, 0x01,		/*   Report ID (1) */
+	0x06, 0x00, 0xff,	/*   Usage Page (Vendor 0xff00) */
+	0x0a, 0x05, 0xff,	/*   Usage (Favorites) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*   Logical Maximum (255) */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x95, 0x01,		/*   Report Count (1) */
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */
+	0xc0			/* End Collection */
+};
+
+/* Slide keys of the Presenter 8000 */
+static const uint8_t sw_rdesc_presenter[] = {
+	0x05, 0x0c,		/* Usage Page (Consumer) */
+	0x09, 0x01,		/* Usage (Consumer Control) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x85, 0x01,		/*   Report ID (1) */
+	0x06, 0x00, 0xff,	/*   Usage Page (Vendor 0xff00) */
+	0x0a, 0x08, 0xfd,	/*   Usage (Forward) */
+	0x0a, 0x09, 0xfd,	/*   Usage (Back) */
+	0x0a, 0x0b, 0xfd,	/*   Usage (Play/Pause) */
+	0x0a, 0x0e, 0xfd,	/*   Usage (Close) */
+	0x0a, 0x0f, 0xfd,	/*   Usage (Play) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x25, 0x01,		/*   Logical Maximum (1) */
+	0x75, 0x01,		/*   Report Size (1) */
+	0x95, 0x05,		/*   Report Count (5) */
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */
+	0x95, 0x03,		/*   Report Count (3) */
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs) */
+	0xc0			/* End Collection */
+};
+
+/*
+ * Plain keyboard keys, as on the standard interface of the X4. Emulated
+ * both as an X4 and as a keyboard hid-generic drives, to check that
+ * hid-microsoft passes them on to hid-input at no extra cost.
+ */
+static const uint8_t sw_rdesc_kbd[] = {
+	0x05, 0x01,		/* Usage Page (Generic Desktop) */
+	0x09, 0x06,		/* Usage (Keyboard) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x85, 0x01,		/*   Report ID (1) */
+	0x05, 0x07,		/*   Usage Page (Keyboard) */
+	0x19, 0xe0,		/*   Usage Minimum (Left Control) */
+	0x29, 0xe7,		/*   Usage Maximum (Right GUI) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x25, 0x01,		/*   Logical Maximum (1) */
+	0x75, 0x01,		/*   Report Size (1) */
+	0x95, 0x08,		/*   Report Count (8) */
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x95, 0x01,		/*   Report Count (1) */
+	0x81, 0x03,		/*   Input (Cnst,Var,Abs) */
+	0x26, 0xff, 0x00,	/*   Logical Maximum (255) */
+	0x19, 0x00,		/*   Usage Minimum (0) */
+	0x29, 0xff,		/*   Usage Maximum (255) */
+	0x95, 0x06,		/*   Report Count (6) */
+	0x81, 0x00,		/*   Input (Data,Arr,Abs) */
+	0xc0			/* End Collection */
+};
+
+/*
+ * Anti-ghosting keyboard interface: modifiers, then one bit for each of
+ * the keyboard usages 0x00 - 0x77, for hid-microsoft's nkro=1 path.
+ */
+static const uint8_t sw_rdesc_nkro[] = {
+	0x05, 0x01,		/* Usage Page (Generic Desktop) */
+	0x09, 0x06,		/* Usage (Keyboard) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x85, 0x01,		/*   Report ID (1) */
+	0x05, 0x07,		/*   Usage Page (Keyboard) */
+	0x19, 0xe0,		/*   Usage Minimum (Left Control) */
+	0x29, 0xe7,		/*   Usage Maximum (Right GUI) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x25, 0x01,		/*   Logical Maximum (1) */
+	0x75, 0x01,		/*   Report Size (1) */
+	0x95, 0x08,		/*   Report Count (8) */
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */
+	0x19, 0x00,		/*   Usage Minimum (0) */
+	0x29, 0x77,		/*   Usage Maximum (0x77) */
+	0x95, 0x78,		/*   Report Count (120) */
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */
+	0xc0			/* End Collection */
+};
+
+#define SW_NKRO_REPORT_SIZE	17
+
+/* One input report to send */
+struct sw_report {
+	uint16_t size;
+	uint8_t data[64];
+};
+
+struct sw_model {
+	const char *name;
+	const char *quirk;		/* quirk class in hid-microsoft */
+	uint32_t vendor;
+	uint32_t product;
+	const uint8_t *rdesc;
+	size_t rsize;
+	unsigned int probe_key;		/* tells our evdev node apart */
+	unsigned int keys;
+	unsigned int events;		/* key events per synthetic report */
+	size_t (*synth)(const struct sw_model *model, struct sw_report **reports);
+};
+
+/*
+ * Synthetic streams: press the first key, release it, press the second
+ * one, ... so every report produces exactly one key event.
+ */
+static struct sw_report *sw_synth_alloc(const struct sw_model *model,
+		uint8_t id, uint16_t size, size_t *n)
+{
+	struct sw_report *r;
+	size_t i;
+
+	*n = 2 * model->keys;
+	r = calloc(*n, sizeof(*r));
+	for (i = 0; r && i < *n; i++) {
+		r[i].size = size;
+		r[i].data[0] = id;
+	}
+	return r;
+}
+
+/* S1 - Sn bitmap, then the Macro Pad, Macro Record and Profile bits */
+static size_t sw_synth_sidewinder(const struct sw_model *model,
+		struct sw_report **reports)
+{
+	unsigned int bytes = (model->keys + 7) / 8;
+	struct sw_report *r;
+	size_t n, i;
+
+	r = sw_synth_alloc(model, SW_MACRO_REPORT, 1 + bytes + 1, &n);
+	if (!r)
+		return 0;
+
+	for (i = 0; i < n; i += 2)
+		r[i].data[1 + (i / 2) / 8] = 1 << ((i / 2) % 8);
+
+	*reports = r;
+	return n;
+}
+
+/* One favorites byte, 0x01 - 0x10 are F14 - F18, 0 releases */
+static size_t sw_synth_ergonomy(const struct sw_model *model,
+		struct sw_report **reports)
+{
+	struct sw_report *r;
+	size_t n, i;
+
+	r = sw_synth_alloc(model, 1, 2, &n);
+	if (!r)
+		return 0;
+
+	for (i = 0; i < n; i += 2)
+		r[i].data[1] = 1 << (i / 2);
+
+	*reports = r;
+	return n;
+}
+
+/* One bit per slide key */
+static size_t sw_synth_presenter(const struct sw_model *model,
+		struct sw_report **reports)
+{
+	return sw_synth_ergonomy(model, reports);
+}
+
+/* One bit per consumer key, in report 1 */
+static size_t sw_synth_consumer(const struct sw_model *model,
+		struct sw_report **reports)
+{
+	return sw_synth_ergonomy(model, reports);
+}
+
+/* A, B, C, ... in the first key array slot */
+static size_t sw_synth_kbd(const struct sw_model *model,
+		struct sw_report **reports)
+{
+	struct sw_report *r;
+	size_t n, i;
+
+	r = sw_synth_alloc(model, 1, 9, &n);
+	if (!r)
+		return 0;
+
+	for (i = 0; i < n; i += 2)
+		r[i].data[3] = 0x04 + i / 2;
+
+	*reports = r;
+	return n;
+}
+
+/*
+ * Full chords: Left Shift and the first @keys letters down in one report,
+ * all released in the next one
+ */
+static size_t sw_synth_nkro(const struct sw_model *model,
+		struct sw_report **reports)
+{
+	struct sw_report *r;
+	unsigned int i;
+
+	r = calloc(2, sizeof(*r));
+	if (!r)
+		return 0;
+
+	r[0].size = r[1].size = SW_NKRO_REPORT_SIZE;
+	r[0].data[0] = r[1].data[0] = 1;
+	r[0].data[1] = 0x02;
+	for (i = 0; i < model->keys - 1; i++)
+		r[0].data[2 + (0x04 + i) / 8] |= 1 << ((0x04 + i) % 8);
+
+	*reports = r;
+	return 2;
+}
+
+static const struct sw_model sw_models[] = {
+	{ "x6", "MS_SIDEWINDER", SW_VENDOR, SW_PRODUCT_X6,
+		sw_rdesc_x6, sizeof(sw_rdesc_x6),
+		KEY_MACRO1, 30, 1, sw_synth_sidewinder },
+	{ "x4", "MS_SIDEWINDER", SW_VENDOR, SW_PRODUCT_X4,
+		sw_rdesc_x4, sizeof(sw_rdesc_x4),
+		KEY_MACRO1, 6, 1, sw_synth_sidewinder },
+	{ "x4-kbd", "MS_SIDEWINDER", SW_VENDOR, SW_PRODUCT_X4,
+		sw_rdesc_kbd, sizeof(sw_rdesc_kbd),
+		KEY_A, 26, 1, sw_synth_kbd },
+	{ "x4-mixed", "MS_SIDEWINDER", SW_VENDOR, SW_PRODUCT_X4,
+		sw_rdesc_x4_mixed, sizeof(sw_rdesc_x4_mixed),
+		KEY_MUTE, 4, 1, sw_synth_consumer },
+	{ "x4-nkro", "MS_SIDEWINDER", SW_VENDOR, SW_PRODUCT_X4,
+		sw_rdesc_nkro, sizeof(sw_rdesc_nkro),
+		KEY_A, 24, 24, sw_synth_nkro },
+	{ "ne4k", "MS_ERGONOMY", SW_VENDOR, SW_PRODUCT_NE4K,
+		sw_rdesc_ne4k, sizeof(sw_rdesc_ne4k),
+		KEY_F14, 5, 1, sw_synth_ergonomy },
+	{ "presenter", "MS_PRESENTER", SW_VENDOR, SW_PRODUCT_PRESENTER,
+		sw_rdesc_presenter, sizeof(sw_rdesc_presenter),
+		KEY_FORWARD, 5, 1, sw_synth_presenter },
+	{ "generic-kbd", "none", SW_VENDOR_GENERIC, SW_PRODUCT_GENERIC,
+		sw_rdesc_kbd, sizeof(sw_rdesc_kbd),
+		KEY_A, 26, 1, sw_synth_kbd },
+	{ "generic-nkro", "none", SW_VENDOR_GENERIC, SW_PRODUCT_GENERIC,
+		sw_rdesc_nkro, sizeof(sw_rdesc_nkro),
+		KEY_A, 24, 24, sw_synth_nkro },
+};
+
+#define SW_MODELS	(sizeof(sw_models) / sizeof(*sw_models))
+
+/* One virtual keyboard */
+struct sw_dev {
+	const struct sw_model *model;
+	int uhid;
+	int evdev;
+	pthread_t thread;
+	volatile bool stop;
+	volatile bool started;
+	unsigned long set_reports;
+	unsigned long get_reports;
+	char name[128];
+};
+
+static uint64_t sw_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int sw_write(struct sw_dev *dev, struct uhid_event *ev)
+{
+	ssize_t ret = write(dev->uhid, ev, sizeof(*ev));
+
+	if (ret < 0)
+		return -errno;
+	return ret == sizeof(*ev) ? 0 : -EFAULT;
+}
+
+/* Answer the driver's feature report requests, like the keyboard does */
+static void *sw_uhid_thread(void *arg)
+{
+	struct sw_dev *dev = arg;
+	struct pollfd pfd = { .fd = dev->uhid, .events = POLLIN };
+	struct uhid_event ev, reply;
+
+	while (!dev->stop) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if (read(dev->uhid, &ev, sizeof(ev)) <= 0)
+			continue;
+
+		memset(&reply, 0, sizeof(reply));
+		switch (ev.type) {
+		case UHID_START:
+			dev->started = true;
+			break;
+		case UHID_SET_REPORT:
+			reply.type = UHID_SET_REPORT_REPLY;
+			reply.u.set_report_reply.id = ev.u.set_report.id;
+			reply.u.set_report_reply.err =
+					ev.u.set_report.rnum == SW_LED_REPORT ? 0 : EIO;
+			__atomic_add_fetch(&dev->set_reports, 1, __ATOMIC_RELAXED);
+			sw_write(dev, &reply);
+			break;
+		case UHID_GET_REPORT:
+			reply.type = UHID_GET_REPORT_REPLY;
+			reply.u.get_report_reply.id = ev.u.get_report.id;
+			reply.u.get_report_reply.err = EIO;
+			dev->get_reports++;
+			sw_write(dev, &reply);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the evdev node of @dev: hid-input may append the application name to
+ * the device name, and only the node with the model's keys is of interest.
+ */
+static int sw_open_evdev(struct sw_dev *dev)
+{
+	unsigned int key = dev->model->probe_key;
+	size_t len = strlen(dev->name);
+	uint8_t keys[KEY_MAX / 8 + 1];
+	struct dirent *de;
+	char path[PATH_MAX], name[256];
+	DIR *dir;
+	int fd;
+
+	dir = opendir("/dev/input");
+	if (!dir)
+		return -errno;
+
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "event", 5))
+			continue;
+		snprintf(path, sizeof(path), "/dev/input/%s", de->d_name);
+		fd = open(path, O_RDONLY | O_NONBLOCK);
+		if (fd < 0)
+			continue;
+
+		memset(keys, 0, sizeof(keys));
+		if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) > 0 &&
+				!strncmp(name, dev->name, len) &&
+				(name[len] == '\0' || name[len] == ' ') &&
+				ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) > 0 &&
+				(keys[key / 8] & (1 << (key % 8)))) {
+			int clock = CLOCK_MONOTONIC;
+
+			ioctl(fd, EVIOCSCLOCKID, &clock);
+			closedir(dir);
+			return fd;
+		}
+		close(fd);
+	}
+
+	closedir(dir);
+	return -ENOENT;
+}
+
+static int sw_create(struct sw_dev *dev, const struct sw_model *model,
+		const uint8_t *rdesc, size_t rsize, int index)
+{
+	struct uhid_event ev;
+	uint64_t deadline;
+	int ret;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->model = model;
+	dev->evdev = -1;
+	if (index < 0)
+		snprintf(dev->name, sizeof(dev->name), "sidewinder-uhid %s %d.load",
+				model->name, getpid());
+	else
+		snprintf(dev->name, sizeof(dev->name), "sidewinder-uhid %s %d.%d",
+				model->name, getpid(), index);
+
+	dev->uhid = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (dev->uhid < 0)
+		return -errno;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "%s",
+			dev->name);
+	ev.u.create2.rd_size = rsize;
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = model->vendor;
+	ev.u.create2.product = model->product;
+	memcpy(ev.u.create2.rd_data, rdesc, rsize);
+
+	ret = sw_write(dev, &ev);
+	if (ret)
+		goto err_close;
+
+	ret = -pthread_create(&dev->thread, NULL, sw_uhid_thread, dev);
+	if (ret)
+		goto err_close;
+
+	/* Wait for the driver to bind and hid-input to register */
+	deadline = sw_now() + 5000000000ull;
+	while (sw_now() < deadline) {
+		if (dev->started) {
+			dev->evdev = sw_open_evdev(dev);
+			if (dev->evdev >= 0)
+				return 0;
+		}
+		usleep(10000);
+	}
+
+	fprintf(stderr, "%s: no evdev node, is hid-microsoft loaded?\n",
+			dev->name);
+	dev->stop = true;
+	pthread_join(dev->thread, NULL);
+	ret = -ENODEV;
+err_close:
+	close(dev->uhid);
+	return ret;
+}
+
+static void sw_destroy(struct sw_dev *dev)
+{
+	struct uhid_event ev = { .type = UHID_DESTROY };
+
+	sw_write(dev, &ev);
+	dev->stop = true;
+	pthread_join(dev->thread, NULL);
+	if (dev->evdev >= 0)
+		close(dev->evdev);
+	close(dev->uhid);
+}
+
+static int sw_send(struct sw_dev *dev, const struct sw_report *report)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = report->size;
+	memcpy(ev.u.input2.data, report->data, report->size);
+
+	return sw_write(dev, &ev);
+}
+
+/* Recorded stream: one report per line, as hex bytes, report ID first */
+static size_t sw_load_reports(const char *file, struct sw_report **reports)
+{
+	struct sw_report *r = NULL;
+	size_t n = 0, alloc = 0;
+	char line[512];
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		char *p = line, *end;
+		unsigned long byte;
+
+		if (n == alloc) {
+			struct sw_report *tmp;
+
+			alloc = alloc ? 2 * alloc : 64;
+			tmp = realloc(r, alloc * sizeof(*r));
+			if (!tmp)
+				break;
+			r = tmp;
+		}
+
+		r[n].size = 0;
+		while (r[n].size < sizeof(r[n].data)) {
+			byte = strtoul(p, &end, 16);
+			if (end == p)
+				break;
+			r[n].data[r[n].size++] = byte;
+			p = end;
+		}
+		if (r[n].size)
+			n++;
+	}
+
+	fclose(f);
+	*reports = r;
+	return n;
+}
+
+static int sw_read_rdesc(const char *file, uint8_t *rdesc, size_t *rsize)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, rdesc, HID_MAX_DESCRIPTOR_SIZE);
+	close(fd);
+
+	if (len <= 0)
+		return -EINVAL;
+	*rsize = len;
+	return 0;
+}
+
+/*
+ * Read what is queued on evdev, returns true once a key event and the
+ * SYN_REPORT after it were seen. @key carries over between calls.
+ */
+static bool sw_read_key(struct sw_dev *dev, bool *key)
+{
+	struct input_event ev[64];
+	ssize_t len;
+	int i;
+
+	len = read(dev->evdev, ev, sizeof(ev));
+	for (i = 0; i < len / (ssize_t)sizeof(*ev); i++) {
+		if (ev[i].type == EV_KEY)
+			*key = true;
+		else if (ev[i].type == EV_SYN && *key)
+			return true;
+	}
+
+	return false;
+}
+
+/* Wait until a key event and its SYN_REPORT were read, or @timeout_ms */
+static int sw_wait_key(struct sw_dev *dev, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = dev->evdev, .events = POLLIN };
+	bool key = false;
+
+	while (poll(&pfd, 1, timeout_ms) > 0) {
+		if (sw_read_key(dev, &key))
+			return 0;
+	}
+
+	return -ETIMEDOUT;
+}
+
+static size_t sw_drain(struct sw_dev *dev, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = dev->evdev, .events = POLLIN };
+	struct input_event ev[64];
+	size_t keys = 0;
+	ssize_t len;
+	int i;
+
+	while (poll(&pfd, 1, timeout_ms) > 0) {
+		len = read(dev->evdev, ev, sizeof(ev));
+		for (i = 0; i < len / (ssize_t)sizeof(*ev); i++)
+			keys += ev[i].type == EV_KEY;
+	}
+
+	return keys;
+}
+
+struct sw_stats {
+	unsigned long count;
+	unsigned long lost;
+	uint64_t *samples;		/* ns, sorted by sw_stats_sort() */
+	uint64_t sum;
+};
+
+static int sw_stats_init(struct sw_stats *st, unsigned long total)
+{
+	memset(st, 0, sizeof(*st));
+	st->samples = calloc(total, sizeof(*st->samples));
+	return st->samples ? 0 : -ENOMEM;
+}
+
+static void sw_stats_add(struct sw_stats *st, uint64_t ns)
+{
+	st->samples[st->count++] = ns;
+	st->sum += ns;
+}
+
+static int sw_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void sw_stats_sort(struct sw_stats *st)
+{
+	qsort(st->samples, st->count, sizeof(*st->samples), sw_cmp_u64);
+}
+
+/* Nearest rank percentile in us, @p in per mille */
+static double sw_stats_pct(const struct sw_stats *st, unsigned int p)
+{
+	unsigned long rank = (st->count * p + 999) / 1000;
+
+	if (!st->count)
+		return 0;
+	return st->samples[rank ? rank - 1 : 0] / 1e3;
+}
+
+/*
+ * Latency: send one report at a time and time until its key event can be
+ * read from evdev.
+ */
+static void sw_bench_latency(struct sw_dev *dev, struct sw_report *reports,
+		size_t n, unsigned long total, struct sw_stats *st)
+{
+	unsigned long i;
+
+	sw_drain(dev, 10);
+	for (i = 0; i < total; i++) {
+		uint64_t start = sw_now();
+
+		if (sw_send(dev, &reports[i % n]))
+			break;
+		if (sw_wait_key(dev, 100))
+			st->lost++;
+		else
+			sw_stats_add(st, sw_now() - start);
+	}
+	sw_stats_sort(st);
+}
+
+/* Throughput: send @total reports at @rate per second, 0 for flat out */
+static void sw_bench_rate(struct sw_dev *dev, struct sw_report *reports,
+		size_t n, unsigned long total, unsigned long rate,
+		double *elapsed, size_t *keys)
+{
+	uint64_t start = sw_now(), next = start;
+	unsigned long i;
+
+	*keys = 0;
+	for (i = 0; i < total; i++) {
+		if (rate) {
+			struct timespec ts;
+
+			next += 1000000000ull / rate;
+			ts.tv_sec = next / 1000000000ull;
+			ts.tv_nsec = next % 1000000000ull;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+		if (sw_send(dev, &reports[i % n]))
+			break;
+		*keys += sw_drain(dev, 0);
+	}
+	*elapsed = (sw_now() - start) / 1e9;
+	*keys += sw_drain(dev, 100);
+}
+
+/*
+ * Background load: busy loops on every CPU, and an extra X6 hammering the
+ * Profile key, so every report goes through ms_sidewinder_control() and
+ * queues a LED SET_REPORT on the workqueue.
+ */
+struct sw_load {
+	pthread_t *cpu;
+	unsigned int cpus;
+	struct sw_dev led;
+	pthread_t led_thread;
+	bool led_running;
+	volatile bool stop;
+};
+
+static void *sw_load_cpu(void *arg)
+{
+	struct sw_load *load = arg;
+	volatile unsigned long spin = 0;
+
+	while (!load->stop)
+		spin++;
+	return NULL;
+}
+
+static void *sw_load_led(void *arg)
+{
+	struct sw_load *load = arg;
+	struct sw_report press = { .size = 6, .data = { SW_MACRO_REPORT } };
+	struct sw_report release = press;
+
+	press.data[5] = 0x04;		/* Profile */
+	while (!load->stop) {
+		sw_send(&load->led, &press);
+		sw_send(&load->led, &release);
+		sw_drain(&load->led, 0);
+	}
+	return NULL;
+}
+
+static int sw_load_start(struct sw_load *load, bool cpu, bool led)
+{
+	unsigned int i;
+	int ret;
+
+	memset(load, 0, sizeof(*load));
+
+	if (led) {
+		ret = sw_create(&load->led, &sw_models[0], sw_models[0].rdesc,
+				sw_models[0].rsize, -1);
+		if (ret)
+			return ret;
+		ret = -pthread_create(&load->led_thread, NULL, sw_load_led, load);
+		if (ret) {
+			sw_destroy(&load->led);
+			return ret;
+		}
+		load->led_running = true;
+	}
+
+	if (cpu) {
+		load->cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		load->cpu = calloc(load->cpus, sizeof(*load->cpu));
+		if (!load->cpu)
+			load->cpus = 0;
+		for (i = 0; i < load->cpus; i++) {
+			if (pthread_create(&load->cpu[i], NULL, sw_load_cpu, load))
+				break;
+		}
+		load->cpus = i;
+	}
+
+	return 0;
+}
+
+static void sw_load_stop(struct sw_load *load)
+{
+	unsigned int i;
+
+	load->stop = true;
+	for (i = 0; i < load->cpus; i++)
+		pthread_join(load->cpu[i], NULL);
+	free(load->cpu);
+
+	if (load->led_running) {
+		pthread_join(load->led_thread, NULL);
+		sw_destroy(&load->led);
+	}
+}
+
+struct sw_result {
+	const struct sw_model *model;
+	unsigned long total;
+	struct sw_stats st;
+	double elapsed;
+	size_t keys;
+	unsigned long set_reports;
+};
+
+static void sw_print_text(const struct sw_result *res)
+{
+	const struct sw_stats *st = &res->st;
+
+	printf("model: %s\n", res->model->name);
+	printf("quirk: %s\n", res->model->quirk);
+	printf("reports: %lu\n", res->total);
+	printf("latency_samples: %lu\n", st->count);
+	printf("latency_lost: %lu\n", st->lost);
+	if (st->count) {
+		printf("latency_min_us: %.1f\n", st->samples[0] / 1e3);
+		printf("latency_avg_us: %.1f\n", st->sum / 1e3 / st->count);
+		printf("latency_p50_us: %.1f\n", sw_stats_pct(st, 500));
+		printf("latency_p99_us: %.1f\n", sw_stats_pct(st, 990));
+		printf("latency_p999_us: %.1f\n", sw_stats_pct(st, 999));
+		printf("latency_max_us: %.1f\n", st->samples[st->count - 1] / 1e3);
+	}
+	printf("reports_per_sec: %.0f\n", res->total / res->elapsed);
+	printf("key_events: %zu\n", res->keys);
+	printf("set_reports: %lu\n", res->set_reports);
+}
+
+/* One object per line and fixed key order, so runs can be diffed */
+static void sw_print_json(const struct sw_result *res, const char *load)
+{
+	const struct sw_stats *st = &res->st;
+
+	printf("{\"model\": \"%s\", \"quirk\": \"%s\", \"load\": \"%s\", "
+			"\"reports\": %lu, \"samples\": %lu, \"lost\": %lu, "
+			"\"min_us\": %.1f, \"avg_us\": %.1f, \"p50_us\": %.1f, "
+			"\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, "
+			"\"reports_per_sec\": %.0f, \"key_events\": %zu, "
+			"\"set_reports\": %lu}\n",
+			res->model->name, res->model->quirk, load,
+			res->total, st->count, st->lost,
+			st->count ? st->samples[0] / 1e3 : 0,
+			st->count ? st->sum / 1e3 / st->count : 0,
+			sw_stats_pct(st, 500), sw_stats_pct(st, 990),
+			sw_stats_pct(st, 999),
+			st->count ? st->samples[st->count - 1] / 1e3 : 0,
+			res->total / res->elapsed, res->keys, res->set_reports);
+}
+
+static int sw_run(const struct sw_model *model, const uint8_t *rdesc,
+		size_t rsize, struct sw_report *reports, size_t n,
+		unsigned long total, unsigned long rate, struct sw_result *res)
+{
+	struct sw_dev dev;
+	int ret;
+
+	memset(res, 0, sizeof(*res));
+	res->model = model;
+	res->total = total;
+
+	ret = sw_stats_init(&res->st, total);
+	if (ret)
+		return ret;
+
+	ret = sw_create(&dev, model, rdesc, rsize, 0);
+	if (ret) {
+		free(res->st.samples);
+		return ret;
+	}
+
+	sw_bench_latency(&dev, reports, n, total, &res->st);
+	sw_bench_rate(&dev, reports, n, total, rate, &res->elapsed, &res->keys);
+	res->set_reports = dev.set_reports;
+
+	sw_destroy(&dev);
+	return 0;
+}
+
+/*
+ * Scaling: @count keyboards driven by @threads threads. Each thread owns a
+ * slice of the keyboards, writes one report to all of them, then collects
+ * the key events in whatever order they come, so a keyboard that is served
+ * late shows up in its latency.
+ */
+struct sw_worker {
+	pthread_t thread;
+	struct sw_dev *devs;
+	struct sw_stats *st;		/* per keyboard */
+	unsigned int count;
+	struct sw_report *reports;
+	size_t n;
+	unsigned long total;
+	size_t keys;
+};
+
+static void *sw_worker_thread(void *arg)
+{
+	struct sw_worker *w = arg;
+	struct pollfd *pfd = calloc(w->count, sizeof(*pfd));
+	uint64_t *start = calloc(w->count, sizeof(*start));
+	bool *key = calloc(w->count, sizeof(*key));
+	unsigned int i, pending;
+	unsigned long r;
+
+	if (!pfd || !start || !key)
+		goto out;
+
+	for (r = 0; r < w->total; r++) {
+		uint64_t deadline;
+
+		for (i = 0; i < w->count; i++) {
+			pfd[i].fd = w->devs[i].evdev;
+			pfd[i].events = POLLIN;
+			key[i] = false;
+			start[i] = sw_now();
+			sw_send(&w->devs[i], &w->reports[r % w->n]);
+		}
+
+		pending = w->count;
+		deadline = sw_now() + 100000000ull;
+		while (pending && sw_now() < deadline) {
+			if (poll(pfd, w->count, 100) <= 0)
+				break;
+			for (i = 0; i < w->count; i++) {
+				if (!(pfd[i].revents & POLLIN))
+					continue;
+				if (!sw_read_key(&w->devs[i], &key[i]))
+					continue;
+				sw_stats_add(&w->st[i], sw_now() - start[i]);
+				w->keys++;
+				pfd[i].fd = -1;		/* done for this round */
+				pending--;
+			}
+		}
+
+		for (i = 0; i < w->count; i++)
+			w->st[i].lost += pfd[i].fd >= 0;
+	}
+
+out:
+	free(pfd);
+	free(start);
+	free(key);
+	return NULL;
+}
+
+/* Busy jiffies of all CPUs, from /proc/stat */
+static int sw_cpu_jiffies(unsigned long long *busy)
+{
+	unsigned long long v[8] = { 0 };
+	FILE *f = fopen("/proc/stat", "r");
+	int i, ret;
+
+	if (!f)
+		return -errno;
+	ret = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(f);
+	if (ret != 8)
+		return -EINVAL;
+
+	for (*busy = 0, i = 0; i < 8; i++)
+		*busy += v[i];
+	*busy -= v[3] + v[4];		/* idle, iowait */
+	return 0;
+}
+
+struct sw_scale_result {
+	const struct sw_model *model;
+	unsigned int count;
+	unsigned int threads;
+	unsigned long total;		/* reports per keyboard */
+	double elapsed;
+	size_t keys;
+	unsigned long lost;
+	double cpu_us_per_event;
+	struct sw_stats all;		/* every keyboard */
+	double dev_p99_min, dev_p99_max;
+	double fairness;		/* Jain's index of the mean latencies */
+};
+
+static int sw_run_scale(const struct sw_model *model, const uint8_t *rdesc,
+		size_t rsize, struct sw_report *reports, size_t n,
+		unsigned long total, unsigned int count, unsigned int threads,
+		struct sw_scale_result *res)
+{
+	unsigned long long busy0 = 0, busy1 = 0;
+	struct sw_worker *workers;
+	struct sw_stats *st;
+	struct sw_dev *devs;
+	double sum = 0, sum2 = 0;
+	unsigned int i, created, per, first;
+	uint64_t start;
+	int ret = -ENOMEM;
+
+	memset(res, 0, sizeof(*res));
+	res->model = model;
+	res->count = count;
+	res->threads = threads = threads > count ? count : threads;
+	res->total = total;
+
+	devs = calloc(count, sizeof(*devs));
+	st = calloc(count, sizeof(*st));
+	workers = calloc(threads, sizeof(*workers));
+	if (!devs || !st || !workers)
+		goto out_free;
+
+	for (created = 0; created < count; created++) {
+		ret = sw_create(&devs[created], model, rdesc, rsize, created);
+		if (ret)
+			goto out_destroy;
+		ret = sw_stats_init(&st[created], total);
+		if (ret) {
+			sw_destroy(&devs[created]);
+			goto out_destroy;
+		}
+		sw_drain(&devs[created], 0);
+	}
+
+	/* Spread the keyboards as evenly as possible */
+	for (i = 0, first = 0; i < threads; i++, first += per) {
+		per = count / threads + (i < count % threads);
+		workers[i].devs = &devs[first];
+		workers[i].st = &st[first];
+		workers[i].count = per;
+		workers[i].reports = reports;
+		workers[i].n = n;
+		workers[i].total = total;
+	}
+
+	sw_cpu_jiffies(&busy0);
+	start = sw_now();
+	for (i = 0; i < threads; i++) {
+		ret = -pthread_create(&workers[i].thread, NULL,
+				sw_worker_thread, &workers[i]);
+		if (ret)
+			break;
+	}
+	while (i--)
+		pthread_join(workers[i].thread, NULL);
+	res->elapsed = (sw_now() - start) / 1e9;
+	if (ret)
+		goto out_destroy;
+	sw_cpu_jiffies(&busy1);
+
+	for (i = 0; i < threads; i++)
+		res->keys += workers[i].keys;
+	if (busy0 && busy1 && res->keys)
+		res->cpu_us_per_event = (busy1 - busy0) * 1e6 /
+				sysconf(_SC_CLK_TCK) / res->keys;
+
+	ret = sw_stats_init(&res->all, count * total);
+	if (ret)
+		goto out_destroy;
+
+	for (i = 0; i < count; i++) {
+		double mean, p99;
+		unsigned long j;
+
+		for (j = 0; j < st[i].count; j++)
+			sw_stats_add(&res->all, st[i].samples[j]);
+		res->lost += st[i].lost;
+
+		sw_stats_sort(&st[i]);
+		p99 = sw_stats_pct(&st[i], 990);
+		if (!i || p99 < res->dev_p99_min)
+			res->dev_p99_min = p99;
+		if (p99 > res->dev_p99_max)
+			res->dev_p99_max = p99;
+
+		mean = st[i].count ? st[i].sum / 1e3 / st[i].count : 0;
+		sum += mean;
+		sum2 += mean * mean;
+	}
+	res->all.lost = res->lost;
+	sw_stats_sort(&res->all);
+	res->fairness = sum2 ? sum * sum / (count * sum2) : 0;
+
+out_destroy:
+	while (created--) {
+		sw_destroy(&devs[created]);
+		free(st[created].samples);
+	}
+out_free:
+	free(workers);
+	free(st);
+	free(devs);
+	return ret;
+}
+
+static void sw_print_scale_text(const struct sw_scale_result *res)
+{
+	const struct sw_stats *st = &res->all;
+
+	printf("model: %s\n", res->model->name);
+	printf("quirk: %s\n", res->model->quirk);
+	printf("devices: %u\n", res->count);
+	printf("threads: %u\n", res->threads);
+	printf("reports: %lu\n", res->total * res->count);
+	printf("key_events: %zu\n", res->keys);
+	printf("lost: %lu\n", res->lost);
+	printf("events_per_sec: %.0f\n", res->keys / res->elapsed);
+	printf("cpu_us_per_event: %.2f\n", res->cpu_us_per_event);
+	printf("latency_p50_us: %.1f\n", sw_stats_pct(st, 500));
+	printf("latency_p99_us: %.1f\n", sw_stats_pct(st, 990));
+	printf("latency_p999_us: %.1f\n", sw_stats_pct(st, 999));
+	printf("device_p99_min_us: %.1f\n", res->dev_p99_min);
+	printf("device_p99_max_us: %.1f\n", res->dev_p99_max);
+	printf("fairness: %.3f\n", res->fairness);
+}
+
+static void sw_print_scale_json(const struct sw_scale_result *res,
+		const char *load)
+{
+	const struct sw_stats *st = &res->all;
+
+	printf("{\"model\": \"%s\", \"quirk\": \"%s\", \"load\": \"%s\", "
+			"\"devices\": %u, \"threads\": %u, \"reports\": %lu, "
+			"\"key_events\": %zu, \"lost\": %lu, "
+			"\"events_per_sec\": %.0f, \"cpu_us_per_event\": %.2f, "
+			"\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+			"\"device_p99_min_us\": %.1f, \"device_p99_max_us\": %.1f, "
+			"\"fairness\": %.3f}\n",
+			res->model->name, res->model->quirk, load,
+			res->count, res->threads, res->total * res->count,
+			res->keys, res->lost, res->keys / res->elapsed,
+			res->cpu_us_per_event, sw_stats_pct(st, 500),
+			sw_stats_pct(st, 990), sw_stats_pct(st, 999),
+			res->dev_p99_min, res->dev_p99_max, res->fairness);
+}
+
+/*
+ * -C: every report sent must have produced its key events, in both the
+ * latency and the throughput run. Returns 0 if so.
+ */
+static int sw_check(const struct sw_model *model, unsigned long reports,
+		unsigned long lost, size_t keys, size_t expected)
+{
+	if (!lost && keys == expected)
+		return 0;
+
+	fprintf(stderr, "%s: FAIL: %zu key events and %lu lost reports, "
+			"expected %zu and 0 (%lu reports)\n", model->name, keys,
+			lost, expected, reports);
+	return -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -m MODEL   x6, x4, x4-kbd, x4-mixed, x4-nkro, ne4k, presenter,\n"
+		"             generic-kbd, generic-nkro or all (default: x6)\n"
+		"  -d FILE    use this report descriptor instead of the built-in one\n"
+		"  -f FILE    replay these reports (hex bytes, one report per line)\n"
+		"  -n COUNT   number of reports to send (default: 10000)\n"
+		"  -r RATE    reports per second for the throughput run, 0 for no limit\n"
+		"             (default: 0)\n"
+		"  -l         keep all CPUs busy while measuring\n"
+		"  -w         keep the LED work busy with another X6 while measuring\n"
+		"  -c COUNT   number of keyboards for the scaling run (default: 1)\n"
+		"  -t COUNT   number of threads driving them (default: 1)\n"
+		"  -j         print one JSON object per model\n"
+		"  -C         exit with 1 if any report did not produce its key events\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t rdesc[HID_MAX_DESCRIPTOR_SIZE];
+	const char *rdesc_file = NULL, *report_file = NULL;
+	unsigned long total = 10000, rate = 0;
+	unsigned int count = 1, threads = 1;
+	bool all = false, cpu_load = false, led_load = false, json = false;
+	bool check = false, failed = false;
+	unsigned int first = 0, i;
+	struct sw_report *reports;
+	struct sw_scale_result scale;
+	struct sw_result res;
+	struct sw_load load;
+	char load_name[16];
+	size_t rsize = 0, n;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "m:d:f:n:r:lwc:t:jCh")) != -1) {
+		switch (opt) {
+		case 'm':
+			all = !strcmp(optarg, "all");
+			for (first = 0; !all && first < SW_MODELS; first++) {
+				if (!strcmp(optarg, sw_models[first].name))
+					break;
+			}
+			if (first == SW_MODELS) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'd':
+			rdesc_file = optarg;
+			break;
+		case 'f':
+			report_file = optarg;
+			break;
+		case 'n':
+			total = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			cpu_load = true;
+			break;
+		case 'w':
+			led_load = true;
+			break;
+		case 'c':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'C':
+			check = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+
+	if (all && (rdesc_file || report_file)) {
+		fprintf(stderr, "-d and -f need a single model\n");
+		return 1;
+	}
+	if (check && report_file) {
+		fprintf(stderr, "-C needs the built-in reports\n");
+		return 1;
+	}
+	if (!total || !count || !threads) {
+		fprintf(stderr, "no reports to send\n");
+		return 1;
+	}
+
+	if (rdesc_file) {
+		ret = sw_read_rdesc(rdesc_file, rdesc, &rsize);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", rdesc_file, strerror(-ret));
+			return 1;
+		}
+	}
+
+	snprintf(load_name, sizeof(load_name), "%s%s%s",
+			cpu_load ? "cpu" : "", cpu_load && led_load ? "+" : "",
+			led_load ? "led" : cpu_load ? "" : "none");
+
+	ret = sw_load_start(&load, cpu_load, led_load);
+	if (ret) {
+		fprintf(stderr, "can't start the load: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	for (i = all ? 0 : first; i < (all ? SW_MODELS : first + 1); i++) {
+		const struct sw_model *model = &sw_models[i];
+
+		if (!rdesc_file) {
+			memcpy(rdesc, model->rdesc, model->rsize);
+			rsize = model->rsize;
+		}
+
+		n = report_file ? sw_load_reports(report_file, &reports) :
+				model->synth(model, &reports);
+		if (!n) {
+			fprintf(stderr, "%s: no reports to send\n", model->name);
+			ret = -EINVAL;
+			break;
+		}
+
+		if (count > 1 || threads > 1)
+			ret = sw_run_scale(model, rdesc, rsize, reports, n,
+					total, count, threads, &scale);
+		else
+			ret = sw_run(model, rdesc, rsize, reports, n, total,
+					rate, &res);
+		free(reports);
+		if (ret) {
+			fprintf(stderr, "can't run %s: %s\n", model->name,
+					strerror(-ret));
+			break;
+		}
+
+		if (count > 1 || threads > 1) {
+			if (json)
+				sw_print_scale_json(&scale, load_name);
+			else
+				sw_print_scale_text(&scale);
+			/* The scaling run counts reports with a key event */
+			if (check && sw_check(model, total * count, scale.lost,
+					scale.keys, total * count))
+				failed = true;
+			free(scale.all.samples);
+		} else {
+			if (json)
+				sw_print_json(&res, load_name);
+			else
+				sw_print_text(&res);
+			if (check && sw_check(model, total, res.st.lost,
+					res.keys, total * model->events))
+				failed = true;
+			free(res.st.samples);
+		}
+	}
+
+	sw_load_stop(&load);
+	return ret || failed;
+}